@@ -0,0 +1,90 @@
+/*
+  commandline.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "commandline.h"
+
+#include "readbatch.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+bool parseUnsigned(const char *str, uint64_t *value)
+{
+    // strtoull() skips spaces and accepts signs, which we don't want
+    if (*str < '0' || *str > '9') {
+        return false;
+    }
+    char *end = nullptr;
+    errno = 0;
+    *value = strtoull(str, &end, 10);
+    return *end == '\0' && errno != ERANGE;
+}
+
+OptionResult parseSnapshotOption(int argc, char *argv[], int *i, PageInfo::Options *options, bool *calibrate)
+{
+    const char *const arg = argv[*i];
+    const bool hasValue = *i + 1 < argc;
+    if (strcmp(arg, "--incremental") == 0) {
+        options->mode = PageInfo::IncrementalMode;
+    } else if (strcmp(arg, "--io-uring") == 0) {
+        ReadBatch::setIoUringEnabled(true);
+    } else if (strcmp(arg, "--calibrate") == 0) {
+        *calibrate = true;
+    } else if (strcmp(arg, "--max-pfn-gap") == 0 && hasValue) {
+        const char *const value = argv[++*i];
+        // 0 is fine, it only merges adjacent PFNs
+        if (!parseUnsigned(value, &options->maxPfnGap)) {
+            cerr << "Invalid PFN gap " << value << '\n';
+            return InvalidOption;
+        }
+    } else if (strcmp(arg, "--sample") == 0 && hasValue) {
+        const char *const value = argv[++*i];
+        char *end = nullptr;
+        options->sampleFraction = strtod(value, &end);
+        if (*end != '\0' || !(options->sampleFraction > 0.0 && options->sampleFraction <= 1.0)) {
+            cerr << "Invalid sample fraction " << value << '\n';
+            return InvalidOption;
+        }
+    } else if (strcmp(arg, "--threads") == 0 && hasValue) {
+        const char *const value = argv[++*i];
+        uint64_t threadCount = 0;
+        if (!parseUnsigned(value, &threadCount) || !threadCount || threadCount > UINT_MAX) {
+            cerr << "Invalid thread count " << value << '\n';
+            return InvalidOption;
+        }
+        options->threadCount = threadCount;
+    } else {
+        return UnknownOption;
+    }
+    return ParsedOption;
+}
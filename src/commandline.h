@@ -0,0 +1,54 @@
+/*
+  commandline.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMMANDLINE_H
+#define COMMANDLINE_H
+
+#include "pageinfo.h"
+
+#include <cstdint>
+
+// Parsing of the command line options that memstat and qmemstat have in common
+
+// Parses a decimal number. Unlike strtoull() alone, it fails for anything else than just a number, e.g.
+// for "", "-1" or "16k", and for numbers that don't fit.
+bool parseUnsigned(const char *str, uint64_t *value);
+
+enum OptionResult {
+    UnknownOption, // not one of the common options
+    ParsedOption,
+    InvalidOption // the option or its argument is invalid; an error may have been printed
+};
+
+// Parses the option at argv[*i] if it is one of the options for taking snapshots: --incremental,
+// --threads <n>, --io-uring, --max-pfn-gap <n>, --calibrate and --sample <fraction>. Their values go to
+// *options, except for --calibrate, which sets *calibrate, and --io-uring, which is applied right away.
+// *i is advanced to the argument of the option, if it has one.
+OptionResult parseSnapshotOption(int argc, char *argv[], int *i, PageInfo::Options *options, bool *calibrate);
+
+#endif // COMMANDLINE_H
@@ -0,0 +1,167 @@
+/*
+  compression.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "compression.h"
+
+#include <cassert>
+#include <cstring>
+
+using namespace std;
+
+// Run-length encoding, a variation of PackBits:
+// control byte c < 128: c + 1 literal bytes follow
+// control byte c >= 128: the next byte repeats c - 128 + minRun times
+static const size_t minRun = 3;
+static const size_t maxRun = 127 + minRun;
+static const size_t maxLiterals = 128;
+
+// byte plane k consists of byte k of every (little endian) uint32_t word; leftover bytes that don't make
+// up a whole word are appended unchanged.
+static void splitBytePlanes(const uint8_t *data, size_t size, uint8_t *planes)
+{
+    const size_t wordCount = size / sizeof(uint32_t);
+    for (size_t i = 0; i < wordCount; i++) {
+        for (size_t k = 0; k < sizeof(uint32_t); k++) {
+            planes[k * wordCount + i] = data[i * sizeof(uint32_t) + k];
+        }
+    }
+    memcpy(planes + wordCount * sizeof(uint32_t), data + wordCount * sizeof(uint32_t),
+           size - wordCount * sizeof(uint32_t));
+}
+
+static void joinBytePlanes(const uint8_t *planes, size_t size, uint8_t *data)
+{
+    const size_t wordCount = size / sizeof(uint32_t);
+    for (size_t k = 0; k < sizeof(uint32_t); k++) {
+        const uint8_t *plane = planes + k * wordCount;
+        for (size_t i = 0; i < wordCount; i++) {
+            data[i * sizeof(uint32_t) + k] = plane[i];
+        }
+    }
+    memcpy(data + wordCount * sizeof(uint32_t), planes + wordCount * sizeof(uint32_t),
+           size - wordCount * sizeof(uint32_t));
+}
+
+// appends at most size + size / maxLiterals + 1 bytes to out
+static void runLengthEncode(const uint8_t *data, size_t size, vector<char> *out)
+{
+    size_t literalStart = 0;
+    auto flushLiterals = [data, out, &literalStart](size_t end) {
+        while (literalStart < end) {
+            const size_t count = min(end - literalStart, maxLiterals);
+            out->push_back(char(count - 1));
+            out->insert(out->end(), data + literalStart, data + literalStart + count);
+            literalStart += count;
+        }
+    };
+
+    size_t i = 0;
+    while (i < size) {
+        size_t runEnd = i + 1;
+        while (runEnd < size && runEnd - i < maxRun && data[runEnd] == data[i]) {
+            runEnd++;
+        }
+        if (runEnd - i >= minRun) {
+            flushLiterals(i);
+            out->push_back(char(128 + runEnd - i - minRun));
+            out->push_back(char(data[i]));
+            literalStart = runEnd;
+            i = runEnd;
+        } else {
+            i++;
+        }
+    }
+    flushLiterals(size);
+}
+
+static bool runLengthDecode(const uint8_t *data, size_t size, uint8_t *out, size_t outSize)
+{
+    size_t outPos = 0;
+    size_t i = 0;
+    while (i < size) {
+        const uint8_t control = data[i++];
+        if (control < 128) {
+            const size_t count = control + 1;
+            if (i + count > size || outPos + count > outSize) {
+                return false;
+            }
+            memcpy(out + outPos, data + i, count);
+            i += count;
+            outPos += count;
+        } else {
+            const size_t count = control - 128 + minRun;
+            if (i >= size || outPos + count > outSize) {
+                return false;
+            }
+            memset(out + outPos, data[i++], count);
+            outPos += count;
+        }
+    }
+    return outPos == outSize;
+}
+
+pair<const char *, size_t> BlockCompressor::compress(const char *data, uint32_t size)
+{
+    assert(size <= maxBlockSize);
+    m_planes.resize(size);
+    splitBytePlanes(reinterpret_cast<const uint8_t *>(data), size, m_planes.data());
+
+    m_block.resize(compressedBlockHeaderSize);
+    runLengthEncode(m_planes.data(), size, &m_block);
+
+    uint32_t compressedSize = m_block.size() - compressedBlockHeaderSize;
+    if (compressedSize >= size) {
+        // incompressible, store instead
+        compressedSize = size;
+        m_block.resize(compressedBlockHeaderSize);
+        m_block.insert(m_block.end(), data, data + size);
+    }
+    memcpy(&m_block[0], &compressedSize, sizeof(uint32_t));
+    memcpy(&m_block[sizeof(uint32_t)], &size, sizeof(uint32_t));
+    return make_pair(m_block.data(), m_block.size());
+}
+
+pair<const char *, size_t> BlockCompressor::endOfFrame()
+{
+    static const uint32_t terminator[2] = { 0, 0 };
+    return make_pair(reinterpret_cast<const char *>(terminator), sizeof(terminator));
+}
+
+bool decompressBlock(const char *data, uint32_t compressedSize, char *out, uint32_t rawSize)
+{
+    if (compressedSize == rawSize) {
+        memcpy(out, data, rawSize);
+        return true;
+    }
+    vector<uint8_t> planes(rawSize);
+    if (!runLengthDecode(reinterpret_cast<const uint8_t *>(data), compressedSize, planes.data(), rawSize)) {
+        return false;
+    }
+    joinBytePlanes(planes.data(), rawSize, reinterpret_cast<uint8_t *>(out));
+    return true;
+}
@@ -0,0 +1,70 @@
+/*
+  compression.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A simple and fast codec for serialized PageInfo data, used with the CompressionFeature of the network
+// protocol. The data mostly consists of uint32_t arrays with long runs of equal values, or at least of
+// equal upper bytes, so the uint32_t words are split into byte planes (all lowest bytes, then all second
+// lowest bytes etc.), which are then run-length encoded.
+//
+// Compressed frame format:
+//    repeat
+//        uint32_t compressed size (== raw size means stored uncompressed, it is never larger)
+//        uint32_t raw size (at most maxBlockSize)
+//        char[compressed size]
+//    until a block with raw size 0 (and compressed size 0)
+
+class BlockCompressor
+{
+public:
+    // returns block header plus block data; valid until the next call
+    std::pair<const char *, size_t> compress(const char *data, uint32_t size);
+    // returns the block that terminates a frame
+    static std::pair<const char *, size_t> endOfFrame();
+
+private:
+    std::vector<uint8_t> m_planes;
+    std::vector<char> m_block;
+};
+
+static const size_t compressedBlockHeaderSize = 2 * sizeof(uint32_t);
+// The serializers hand out at most this much data at a time, so no block is larger. Readers reject larger
+// ones instead of allocating for them.
+static const uint32_t maxBlockSize = 16 * 1024;
+
+// out must have room for rawSize bytes. Returns false if the data is invalid.
+bool decompressBlock(const char *data, uint32_t compressedSize, char *out, uint32_t rawSize);
+
+#endif // COMPRESSION_H
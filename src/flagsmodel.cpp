@@ -60,10 +60,11 @@ static const char *pageFlagNames[pageFlagCount] = {
     nullptr,
     nullptr,
     nullptr,
-    nullptr,
     // flags from /proc/<pid>/pagemap, also documented in linux/Documentation/vm/pagemap.txt -
     // we shift them around a bit to clearly group them together and away from the other group,
-    // as documented in readPagemap() in pageinfo.cpp: 55-> 28 ; 61 -> 29 ; 62 -> 30; 63 -> 31
+    // as documented in combinedFlagsForPagemapEntry() in pageinfo.cpp:
+    // 56 -> 27 ; 55-> 28 ; 61 -> 29 ; 62 -> 30; 63 -> 31
+    "EXCLUSIVE", // 27
     "SOFT_DIRTY",
     "FILE_PAGE / SHARE_ANON", // 29
     "SWAPPED",
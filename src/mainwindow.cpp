@@ -31,13 +31,15 @@
 #include "flagsmodel.h"
 #include "mosaicwidget.h"
 
+#include <QAction>
 #include <QBoxLayout>
+#include <QKeySequence>
 #include <QLabel>
 #include <QListView>
 #include <QTextEdit>
 
-MainWindow::MainWindow(uint pid)
-   : m_mosaicWidget(new MosaicWidget(pid))
+MainWindow::MainWindow(uint pid, const PageInfo::Options &options)
+   : m_mosaicWidget(new MosaicWidget(pid, options))
 {
     init();
 }
@@ -93,6 +95,16 @@ void MainWindow::init()
             this, SLOT(showPageInfo(quint64, quint32, QString)));
     connect(m_mosaicWidget, SIGNAL(serverConnectionBroke(bool)), this, SLOT(serverConnectionBroke(bool)));
 
+    // Ctrl+plus and Ctrl+minus on most platforms
+    QAction *zoomInAction = new QAction(QString::fromLatin1("Zoom in"), this);
+    zoomInAction->setShortcut(QKeySequence::ZoomIn);
+    connect(zoomInAction, SIGNAL(triggered()), m_mosaicWidget, SLOT(zoomIn()));
+    addAction(zoomInAction);
+    QAction *zoomOutAction = new QAction(QString::fromLatin1("Zoom out"), this);
+    zoomOutAction->setShortcut(QKeySequence::ZoomOut);
+    connect(zoomOutAction, SIGNAL(triggered()), m_mosaicWidget, SLOT(zoomOut()));
+    addAction(zoomOutAction);
+
     setCentralWidget(mainContainer);
 }
 
@@ -107,8 +119,10 @@ void MainWindow::showPageInfo(quint64 addr, quint32 useCount, const QString &bac
     }
     if (addr) {
         QString backingFileText = backingFile.isEmpty() ? QString::fromLatin1("[none]") : backingFile;
+        QString useCountText = useCount == PageRun::unsampledUseCount ? QString::fromLatin1("not sampled")
+                                                                      : QString::number(useCount);
         QString infoText = QString::fromLatin1("Address:\t0x%1\nUse count:\t%2\nBacking file:\n%3")
-            .arg(addr, 0, 16).arg(useCount).arg(backingFileText);
+            .arg(addr, 0, 16).arg(useCountText).arg(backingFileText);
         if (m_serverConnectionBroken) {
             infoText.prepend(QString::fromLatin1("Disconnected from server.\n"));
         }
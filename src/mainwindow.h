@@ -31,6 +31,8 @@
 
 #include <QMainWindow>
 
+#include "pageinfo.h"
+
 class MosaicWidget;
 class QTextEdit;
 
@@ -40,9 +42,11 @@ class MainWindow : public QMainWindow
 public:
     // parameters are forwarded to MosaicWidget... this is probably going to change when
     // MainWindow becomes more like a proper main window.
-    MainWindow(uint pid);
+    MainWindow(uint pid, const PageInfo::Options &options);
     MainWindow(const QByteArray &host, uint port);
 
+    MosaicWidget *mosaicWidget() const { return m_mosaicWidget; }
+
 private slots:
     void showPageInfo(quint64 addr, quint32 useCount, const QString &backingFile);
     void serverConnectionBroke(bool);
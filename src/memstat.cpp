@@ -30,6 +30,7 @@
 #include "pageinfo.h"
 
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -39,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <unistd.h>
 
 // ### those two "should" be included from /usr/include/linux, but since the kernel gives an ABI
@@ -47,6 +49,10 @@
 #include "kernel-page-flags.h"
 #include "linux-pm-bits.h"
 
+#include "commandline.h"
+#include "compression.h"
+#include "pageinfoprotocol.h"
+
 using namespace std;
 
 static const uint maxProcessNameLength = 15; // with the way we use to read it
@@ -55,53 +61,243 @@ static const uint defaultPort = 5550;
 
 #include "pageinfoserializer.cpp"
 
-static bool isFlagSet(uint64_t flags, uint testFlagShift)
+// ProtocolFeature flags that we support
+static const uint32_t supportedFeatures = DeltaFeature | CompressionFeature | RunsFeature;
+
+// send a DeltaFrame only if the previous KeyFrame was less than that many frames ago
+static const uint keyFrameInterval = 64;
+
+static void printTotals(uint64_t vsz, uint64_t rss, uint64_t pss)
 {
-    return flags & (1 << testFlagShift);
+    cout << "VSZ is " << vsz / 1024 / 1024 << "MiB\n";
+    cout << "RSS is " << rss / 1024 / 1024 << "MiB\n";
+    cout << "PSS is " << pss / 1024 / 1024 << "MiB\n";
+}
+
+// sizes in bytes
+struct PageTotals
+{
+    PageTotals()
+       : pagesWithZeroUseCount(0),
+         priv(0),
+         sharedFull(0),
+         sharedProp(0)
+    {}
+    uint64_t rss() const { return priv + sharedFull; }
+    uint64_t pss() const { return priv + sharedProp; }
+
+    uint64_t pagesWithZeroUseCount;
+    uint64_t priv;
+    uint64_t sharedFull;
+    uint64_t sharedProp;
+};
+
+// adds pages [firstPage, endPage) of mr to *totals
+static void addPageTotals(const MappedRegion &mr, uint64_t firstPage, uint64_t endPage, PageTotals *totals)
+{
+    // uniform runs of pages, e.g. large unpopulated areas, are handled in one step
+    for (PageSpanIterator span(mr, firstPage); !span.atEnd() && span->firstPage < endPage; ++span) {
+        uint64_t useCount = span->useCount;
+        const uint64_t pageCount = min(span->firstPage + span->pageCount, endPage) - span->firstPage;
+        const uint64_t size = pageCount * PageInfo::pageSize;
+        // Tail pages of huge pages have the use count of their head page, even on kernels that report
+        // 0 for them - if the huge page was found as a whole. Those in sample clusters and in partially
+        // or PTE-mapped THPs are read one by one, so take a use count of 0 with these flags to mean that
+        // the page is resident, and mapped privately as far as we can tell.
+        if (useCount == 0 && (span->combinedFlags & ((1u << KPF_COMPOUND_TAIL) | (1u << KPF_THP)))) {
+            useCount = 1;
+        }
+        if (useCount == 1) {
+            // divisions are very slow even on modern CPUs
+            totals->priv += size;
+        } else if (useCount == 0) {
+            totals->pagesWithZeroUseCount += pageCount;
+        } else {
+            assert(useCount != PageRun::unsampledUseCount);
+            totals->sharedFull += size;
+            totals->sharedProp += size / useCount;
+        }
+    }
+}
+
+// Estimates for the sampled regions of a snapshot, see SampleStratum. Each stratum has two clusters, each
+// of which gives an estimate for the whole stratum: twice its value times the number of places it was
+// picked from. Their mean is the estimate for the stratum, and their difference says how good it is.
+struct SampleEstimate
+{
+    SampleEstimate()
+       : pagesWithZeroUseCount(0),
+         rss(0),
+         pss(0),
+         rssVariance(0),
+         pssVariance(0)
+    {}
+    void addStratum(const MappedRegion &mr, const SampleStratum &stratum);
+    // half the width of a 95% confidence interval, assuming a normal distribution
+    static uint64_t margin(double variance) { return uint64_t(1.96 * sqrt(variance)); }
+
+    double pagesWithZeroUseCount;
+    double rss;
+    double pss;
+    double rssVariance;
+    double pssVariance;
+};
+
+void SampleEstimate::addStratum(const MappedRegion &mr, const SampleStratum &stratum)
+{
+    const double stratumPages = stratum.endPage - stratum.firstPage;
+    uint64_t sampledPages = 0;
+    PageTotals clusterTotals[2];
+    double scale[2];
+    for (int i = 0; i < 2; i++) {
+        addPageTotals(mr, stratum.clusterFirst[i], stratum.clusterEnd[i], &clusterTotals[i]);
+        sampledPages += stratum.clusterEnd[i] - stratum.clusterFirst[i];
+        // Not the stratum size divided by the cluster size: that would overrate the shorter last cluster of
+        // a half. This is unbiased because each cluster is equally likely to be picked.
+        scale[i] = 2.0 * stratum.clusterPositions[i];
+    }
+    // finite population correction: the more of the stratum was read, the less there is to guess
+    const double correction = 1.0 - sampledPages / stratumPages;
+    auto add = [correction](double estimate0, double estimate1, double *total, double *variance) {
+        *total += (estimate0 + estimate1) / 2;
+        // the usual variance estimator for two samples per stratum
+        if (variance) {
+            *variance += correction * (estimate0 - estimate1) * (estimate0 - estimate1) / 4;
+        }
+    };
+    add(scale[0] * clusterTotals[0].rss(), scale[1] * clusterTotals[1].rss(), &rss, &rssVariance);
+    add(scale[0] * clusterTotals[0].pss(), scale[1] * clusterTotals[1].pss(), &pss, &pssVariance);
+    add(scale[0] * clusterTotals[0].pagesWithZeroUseCount, scale[1] * clusterTotals[1].pagesWithZeroUseCount,
+        &pagesWithZeroUseCount, nullptr);
 }
 
 void printSummary(const PageInfo &pageInfo)
 {
     const vector<MappedRegion> &mappedRegions = pageInfo.mappedRegions();
 
-    uint64_t pagesWithZeroUseCount = 0;
     uint64_t vsz = 0;
-    uint64_t priv = 0;
-    uint64_t sharedFull = 0;
-    uint64_t sharedProp = 0;
+    PageTotals totals; // of the regions that were read completely
+    SampleEstimate estimate; // of the others
+    bool isSampled = false;
 
     for (const MappedRegion &mr : mappedRegions) {
         vsz += mr.end - mr.start;
-        uint64_t addr = mr.start;
-        for (size_t i = 0; i < mr.useCounts.size(); i++, addr += PageInfo::pageSize) {
-            uint64_t useCount = mr.useCounts[i];
-            uint64_t pageFlags = mr.combinedFlags[i];
-            // currently, use count is misreported as 0 for transparent hugepage tail (all after the first)
-            // pages - it should be 1
-            // ### should we also copy flags from the head page to tail pages?
-            if (useCount == 1 || isFlagSet(pageFlags, KPF_THP)) {
-                // divisions are very slow even on modern CPUs
-                priv += PageInfo::pageSize;
-            } else if (useCount == 0) {
-                pagesWithZeroUseCount++;
-            } else {
-                sharedFull += PageInfo::pageSize;
-                sharedProp += PageInfo::pageSize / useCount;
+        if (mr.sampleStrata.empty()) {
+            addPageTotals(mr, 0, mr.pageCount(), &totals);
+        } else {
+            isSampled = true;
+            for (const SampleStratum &stratum : mr.sampleStrata) {
+                estimate.addStratum(mr, stratum);
             }
         }
-        assert(addr == mr.end);
     }
 
-    cout << "VSZ is " << vsz / 1024 / 1024 << "MiB\n";
-    cout << "RSS is " << (priv + sharedFull) / 1024 / 1024 << "MiB\n";
-    cout << "PSS is " << (priv + sharedProp) / 1024 / 1024 << "MiB\n";
-    cout << "number of pages with zero use count is " << pagesWithZeroUseCount << '\n';
+    if (!isSampled) {
+        printTotals(vsz, totals.rss(), totals.pss());
+        cout << "number of pages with zero use count is " << totals.pagesWithZeroUseCount << '\n';
+        return;
+    }
+    // round the margins up, they are upper bounds
+    static const uint64_t mib = 1024 * 1024;
+    cout << "VSZ is " << vsz / mib << "MiB\n";
+    cout << "RSS is about " << (totals.rss() + uint64_t(estimate.rss)) / mib << "MiB +- "
+         << (SampleEstimate::margin(estimate.rssVariance) + mib - 1) / mib << "MiB\n";
+    cout << "PSS is about " << (totals.pss() + uint64_t(estimate.pss)) / mib << "MiB +- "
+         << (SampleEstimate::margin(estimate.pssVariance) + mib - 1) / mib << "MiB\n";
+    cout << "(estimated from sampled pages, with 95% confidence intervals)\n";
+    cout << "number of pages with zero use count is about "
+         << totals.pagesWithZeroUseCount + uint64_t(estimate.pagesWithZeroUseCount) << '\n';
+}
+
+// returns false if the client did not send a ProtocolHello, i.e. it only understands full snapshots
+static bool negotiateProtocol(int connFd, uint32_t ourFeatures, uint32_t *features)
+{
+    // old clients never send anything, so don't wait for long
+    static const int helloTimeoutMs = 1000;
+
+    pollfd pfd;
+    pfd.fd = connFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ProtocolHello hello;
+    if (poll(&pfd, 1, helloTimeoutMs) != 1 ||
+        recv(connFd, &hello, sizeof(hello), MSG_WAITALL) != ssize_t(sizeof(hello)) ||
+        hello.magic != protocolMagic) {
+        return false;
+    }
+    *features = hello.features & ourFeatures;
+    hello.features = *features;
+    hello.reserved = 0;
+    return write(connFd, &hello, sizeof(hello)) == ssize_t(sizeof(hello));
+}
+
+// compressor may be null
+template<typename Serializer>
+static bool sendSerialized(int connFd, Serializer *serializer, BlockCompressor *compressor)
+{
+    while (true) {
+        pair<const char*, size_t> ser = serializer->serializeMore();
+        if (ser.second == 0) {
+            if (compressor) {
+                ser = BlockCompressor::endOfFrame();
+                return write(connFd, ser.first, ser.second) == ssize_t(ser.second);
+            }
+            return true;
+        }
+        if (compressor) {
+            ser = compressor->compress(ser.first, ser.second);
+        }
+        if (write(connFd, ser.first, ser.second) < ssize_t(ser.second)) {
+            return false;
+        }
+    }
+}
+
+static bool sendFrameType(int connFd, FrameType frameType)
+{
+    return write(connFd, &frameType, sizeof(frameType)) == ssize_t(sizeof(frameType));
+}
+
+// returns false if calibration failed
+static bool calibrate(PageInfo::Options *options)
+{
+    double perReadNs = 0;
+    double perPfnNs = 0;
+    const uint64_t maxPfnGap = PageInfo::calibrateMaxPfnGap(&perReadNs, &perPfnNs);
+    if (!maxPfnGap) {
+        cerr << "Could not measure PFN read cost. Maybe you are not root?\n";
+        return false;
+    }
+    cerr << "PFN read cost: " << perReadNs << "ns per read + " << perPfnNs << "ns per PFN, "
+         << "using --max-pfn-gap " << maxPfnGap << '\n';
+    options->maxPfnGap = maxPfnGap;
+    return true;
 }
 
 static void printUsage()
 {
-    cerr << "Usage: memstat <pid>/<process-name>\n"
-         << "       memstat <pid>/<process-name> [--server [<portnumber>]]\n";
+    cerr << "Usage: memstat <pid>/<process-name> [options]\n"
+         << "       memstat <pid>/<process-name> --server [<portnumber>] [--incremental |\n"
+         << "                                                     --memory-limit <MiB>] [options]\n"
+         << "       memstat --calibrate\n"
+         << "Options:\n"
+         << "  --incremental  only update pages written to since the previous snapshot. This clears the\n"
+         << "                 soft-dirty bits of the process, so it interferes with other users of them.\n"
+         << "  --memory-limit <MiB>  in server mode, collect and send each snapshot in parts so that the\n"
+         << "                 page information in memory stays roughly below the limit. Parts are\n"
+         << "                 collected at slightly different times, and only full snapshots are sent.\n"
+         << "  --threads <n>  use n threads to read and combine page information (default: 1)\n"
+         << "  --io-uring     read page information in batches using io_uring, if available\n"
+         << "  --max-pfn-gap <n>  read PFN information for PFNs up to n apart in one go (default: "
+         << PageInfo::defaultMaxPfnGap << ")\n"
+         << "  --calibrate    measure the best value for --max-pfn-gap on this system and use it\n"
+         << "  --level <level>  what to collect in local mode:\n"
+         << "                 rollup: only the totals the kernel keeps (fastest; no root needed for\n"
+         << "                         processes of the same user)\n"
+         << "                 counts: use counts of all pages, but not their flags\n"
+         << "                 full:   use counts and flags of all pages (default)\n"
+         << "  --sample <fraction>  in local mode, read only about that fraction (e.g. 0.01) of the pages\n"
+         << "                 of large mappings, and estimate RSS and PSS from them\n";
 }
 
 int main(int argc, char *argv[])
@@ -113,23 +309,72 @@ int main(int argc, char *argv[])
 
     bool network = false;
     uint port = defaultPort;
+    PageInfo::Options options;
 
-    if (argc > 2) {
-        network = true;
-        if (string(argv[2]) != ("--server") || argc > 4) {
+    if (string(argv[1]) == "--calibrate") {
+        if (argc != 2) {
             printUsage();
             return -1;
         }
+        return calibrate(&options) ? 0 : 1;
+    }
 
-        if (argc == 4) {
-            port = strtoul(argv[3], nullptr, 10);
-            if (!port) {
-                cerr << "Invalid port number " << argv[3] << '\n';
+    bool doCalibrate = false;
+    bool rollup = false;
+    size_t memoryLimit = 0;
+    for (int i = 2; i < argc; i++) {
+        const string arg = argv[i];
+        if (arg == "--server" && !network) {
+            network = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                i++;
+                port = strtoul(argv[i], nullptr, 10);
+                if (!port) {
+                    cerr << "Invalid port number " << argv[i] << '\n';
+                    printUsage();
+                    return -1;
+                }
+            }
+        } else if (arg.compare(0, 8, "--level=") == 0 || (arg == "--level" && i + 1 < argc)) {
+            const string level = arg == "--level" ? argv[++i] : arg.substr(8);
+            rollup = level == "rollup";
+            if (level == "counts") {
+                options.level = PageInfo::CountsLevel;
+            } else if (level == "full") {
+                options.level = PageInfo::FullLevel;
+            } else if (!rollup) {
+                cerr << "Invalid level " << level << '\n';
                 printUsage();
                 return -1;
             }
+        } else if (arg == "--memory-limit" && i + 1 < argc) {
+            i++;
+            memoryLimit = size_t(strtoull(argv[i], nullptr, 10)) * 1024 * 1024;
+            if (!memoryLimit) {
+                cerr << "Invalid memory limit " << argv[i] << '\n';
+                printUsage();
+                return -1;
+            }
+        } else if (parseSnapshotOption(argc, argv, &i, &options, &doCalibrate) != ParsedOption) {
+            printUsage();
+            return -1;
         }
     }
+    if (options.mode == PageInfo::IncrementalMode && !network) {
+        // a single snapshot can't profit, and clearing the soft-dirty bits has side effects
+        printUsage();
+        return -1;
+    }
+    if (network && (rollup || options.level != PageInfo::FullLevel || options.sampleFraction < 1.0)) {
+        // the client shows everything
+        printUsage();
+        return -1;
+    }
+    if (memoryLimit && (!network || options.mode == PageInfo::IncrementalMode)) {
+        // incremental updates need the complete previous snapshot in memory
+        printUsage();
+        return -1;
+    }
 
     uint pid = strtoul(argv[1], nullptr, 10);
     if (!pid) {
@@ -145,11 +390,24 @@ int main(int argc, char *argv[])
         cerr << "Found no such PID or process " << argv[1] << "!\n";
         return -1;
     }
+    // after --io-uring has been applied, which changes the cost of reads
+    if (doCalibrate && !calibrate(&options)) {
+        return 1;
+    }
 
 
     if (!network) {
         cerr << "local mode.\n";
-        PageInfo pageInfo(pid);
+        if (rollup) {
+            MemoryRollup memoryRollup;
+            if (!readMemoryRollup(pid, &memoryRollup)) {
+                cerr << "Could not read memory totals. Maybe you are not root?\n";
+                return 1;
+            }
+            printTotals(memoryRollup.vsz, memoryRollup.rss, memoryRollup.pss);
+            return 0;
+        }
+        PageInfo pageInfo(pid, options);
         if (pageInfo.mappedRegions().empty()) {
             cerr << "Could not read page information. Maybe you are not root?\n";
             return 1;
@@ -186,21 +444,69 @@ int main(int argc, char *argv[])
     }
     close(listenFd);
 
+    uint32_t ourFeatures = supportedFeatures;
+    if (memoryLimit) {
+        // Deltas need two complete snapshots in memory, which is what a memory limit is supposed to
+        // prevent. The runs of a region are only known once all of its pages are collected, which may
+        // happen in several parts.
+        ourFeatures &= ~(DeltaFeature | RunsFeature);
+    }
+    uint32_t features = 0;
+    const bool useFrames = negotiateProtocol(connFd, ourFeatures, &features);
+    const bool useDeltaFrames = features & DeltaFeature;
+    const bool useRuns = features & RunsFeature;
+    BlockCompressor compressor;
+    BlockCompressor *const maybeCompressor = (features & CompressionFeature) ? &compressor : nullptr;
+
+    if (memoryLimit) {
+        PageStreamer streamer(pid, memoryLimit, options);
+        while (true) {
+            streamer.start();
+            if (useFrames) {
+                sendFrameType(connFd, KeyFrame);
+            }
+            // collects the snapshot part by part while sending it
+            PageInfoSerializer serializer(&streamer);
+            sendSerialized(connFd, &serializer, maybeCompressor);
+        }
+    }
+
+    PageCollector collector(pid, options);
+    uint framesSinceKeyFrame = 0;
+
     while (true) {
-        // destroy PageInfo and PageInfoSerializer when done sending to free their memory...
+        // destroy PageInfoSerializer when done sending to free its memory...
         {
-            PageInfo pageInfo(pid);
-            // serialize PageInfo output (vector<MappedRegion>) while sending, to avoid using even
-            // more memory on the target system.
-            PageInfoSerializer serializer(pageInfo);
-            while (true) {
-                pair<const char*, size_t> ser = serializer.serializeMore();
-                if (ser.second == 0) {
-                    break;
+            const PageInfo &pageInfo = collector.collect();
+            // every snapshot is sent, so this is what the client has
+            const PageInfo *const previousPageInfo = collector.previous();
+
+            bool sentDelta = false;
+            if (useDeltaFrames && previousPageInfo && framesSinceKeyFrame < keyFrameInterval) {
+                // when the changes are large, sending them doesn't save much, but costs memory on the target
+                PageInfoDeltaSerializer serializer(*previousPageInfo, pageInfo, useRuns,
+                                                   serializedSize(pageInfo.mappedRegions(), useRuns) / 2);
+                if (serializer.isValid()) {
+                    sendFrameType(connFd, DeltaFrame);
+                    sendSerialized(connFd, &serializer, maybeCompressor);
+                    framesSinceKeyFrame++;
+                    sentDelta = true;
+                }
+            }
+            if (!sentDelta) {
+                if (useFrames) {
+                    sendFrameType(connFd, KeyFrame);
                 }
-                if (write(connFd, ser.first, ser.second) < ssize_t(ser.second)) {
-                    break;
+                // serialize PageInfo output (vector<MappedRegion>) while sending, to avoid using even
+                // more memory on the target system.
+                if (useRuns) {
+                    PageInfoRunsSerializer serializer(pageInfo);
+                    sendSerialized(connFd, &serializer, maybeCompressor);
+                } else {
+                    PageInfoSerializer serializer(pageInfo);
+                    sendSerialized(connFd, &serializer, maybeCompressor);
                 }
+                framesSinceKeyFrame = 0;
             }
         }
         //sleep(5);
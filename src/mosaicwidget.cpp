@@ -28,14 +28,27 @@
 
 #include "mosaicwidget.h"
 
+#include "compression.h"
+#include "pageinfoprotocol.h"
+
 #include <cassert>
+#include <cstring>
 #include <limits>
+#include <thread>
 #include <utility>
 
 #include <linux/kernel-page-flags.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <QEvent>
 #include <QMouseEvent>
+#include <QPainter>
+#include <QScrollBar>
+#include <QTimer>
+#include <QWheelEvent>
 
 using namespace std;
 
@@ -74,10 +87,11 @@ static const char *pageFlagNames[pageFlagCount] = {
     nullptr,
     nullptr,
     nullptr,
-    nullptr,
     // flags from /proc/<pid>/pagemap, also documented in linux/Documentation/vm/pagemap.txt -
     // we shift them around a bit to clearly group them together and away from the other group,
-    // as documented in readPagemap() in pageinfo.cpp: 55-> 28 ; 61 -> 29 ; 62 -> 30; 63 -> 31
+    // as documented in combinedFlagsForPagemapEntry() in pageinfo.cpp:
+    // 56 -> 27 ; 55-> 28 ; 61 -> 29 ; 62 -> 30; 63 -> 31
+    "EXCLUSIVE", // 27
     "SOFT_DIRTY",
     "FILE_PAGE / SHARE_ANON", // 29
     "SWAPPED",
@@ -107,8 +121,38 @@ QString printablePageFlags(uint32_t flags)
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-static const uint s_pixelsPerTile = 4;
+// tiles are squares of 1, 2, 4 or 8 pixels, depending on the zoom level
+static const uint s_minPixelsPerTile = 1;
+static const uint s_maxPixelsPerTile = 8;
+static const uint s_defaultPixelsPerTile = 4;
 static const uint s_columnCount = 512;
+static const uint s_tilesPerSeparator = 2;
+// rows rendered above and below the visible ones
+static const quint32 s_marginRows = 64;
+// Minimum rows per band when rendering on several threads. Smaller bands don't pay for waking a thread.
+static const quint32 s_minBandRows = 64;
+
+QByteArray PageInfoReader::protocolHello()
+{
+    ProtocolHello hello;
+    hello.magic = protocolMagic;
+    hello.features = DeltaFeature | CompressionFeature | RunsFeature;
+    hello.reserved = 0;
+    return QByteArray(reinterpret_cast<const char *>(&hello), sizeof(hello));
+}
+
+// Returns false instead of reading past length, so that truncated or corrupt data can't make us read
+// outside of the buffer or frame. *pos is always <= length.
+template<typename T>
+static bool readPrimitive(const char *buf, size_t length, size_t *pos, T *value)
+{
+    if (length - *pos < sizeof(T)) {
+        return false;
+    }
+    memcpy(value, buf + *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
+}
 
 bool PageInfoReader::addData(const QByteArray &data)
 {
@@ -116,46 +160,516 @@ bool PageInfoReader::addData(const QByteArray &data)
     bool ret = false;
     // is not guaranteed that there is one or less dataset per chunk of data received, so keep looping
     while (true) {
-        if (m_length < 0 && size_t(m_buffer.length()) >= sizeof(size_t)) {
-            m_length = *reinterpret_cast<const uint64_t *>(m_buffer.constData());
+        if (m_protocol == UnknownProtocol) {
+            if (size_t(m_buffer.length()) < sizeof(uint64_t)) {
+                break;
+            }
+            if (*reinterpret_cast<const uint64_t *>(m_buffer.constData()) != protocolMagic) {
+                m_protocol = FullSnapshotsProtocol;
+                continue;
+            }
+            if (size_t(m_buffer.length()) < sizeof(ProtocolHello)) {
+                break;
+            }
+            // the server may only use features we asked for, so there is not much to check here
+            const ProtocolHello *hello = reinterpret_cast<const ProtocolHello *>(m_buffer.constData());
+            m_isCompressed = hello->features & CompressionFeature;
+            m_hasRuns = hello->features & RunsFeature;
+            m_buffer.remove(0, sizeof(ProtocolHello));
+            m_protocol = FramesProtocol;
         }
-        if (m_length >= 0 && size_t(m_buffer.length()) >= m_length + sizeof(size_t)) {
+
+        if (m_isCompressed) {
+            bool frameDone = false;
+            if (!readCompressedBlock(&frameDone)) {
+                break;
+            }
+            ret = ret || frameDone;
+            continue;
+        }
+
+        const size_t headerSize = (m_protocol == FramesProtocol ? sizeof(m_frameType) : 0) + sizeof(uint64_t);
+        if (m_length < 0 && size_t(m_buffer.length()) >= headerSize) {
+            m_frameType = m_protocol == FramesProtocol
+                            ? *reinterpret_cast<const uint32_t *>(m_buffer.constData()) : KeyFrame;
+            m_length = *reinterpret_cast<const uint64_t *>(m_buffer.constData() + headerSize - sizeof(uint64_t));
+        }
+        if (m_length >= 0 && size_t(m_buffer.length()) >= m_length + headerSize) {
             ret = true;
+            processFrame(m_frameType, m_buffer.constData() + headerSize, m_length);
+            m_buffer.remove(0, m_length + headerSize);
+            m_length = -1;
+        } else {
+            break;
+        }
+    }
+    return ret;
+}
+
+bool PageInfoReader::readCompressedBlock(bool *frameDone)
+{
+    const char *const buf = m_buffer.constData();
+    const size_t length = m_buffer.length();
+    size_t pos = 0;
+    if (!m_inCompressedFrame) {
+        if (!readPrimitive(buf, length, &pos, &m_frameType)) {
+            return false;
+        }
+        m_buffer.remove(0, pos);
+        m_inCompressedFrame = true;
+        m_isFrameValid = true;
+        m_frame.clear();
+        return true;
+    }
+
+    uint32_t compressedSize = 0;
+    uint32_t rawSize = 0;
+    if (!readPrimitive(buf, length, &pos, &compressedSize) || !readPrimitive(buf, length, &pos, &rawSize)) {
+        return false;
+    }
+    // The sizes come from the network, so don't allocate or wait for more data than a valid block can have.
+    // Where the next block starts is unknown after an invalid header, so only the header is skipped; the
+    // frame is discarded either way.
+    if (rawSize > maxBlockSize || compressedSize > rawSize) {
+        m_isFrameValid = false;
+        m_buffer.remove(0, pos);
+        return true;
+    }
+    if (length - pos < compressedSize) {
+        return false;
+    }
+
+    if (rawSize) {
+        const size_t framePos = m_frame.size();
+        m_frame.resize(framePos + rawSize);
+        m_isFrameValid = m_isFrameValid &&
+                         decompressBlock(buf + pos, compressedSize, &m_frame[framePos], rawSize);
+    } else {
+        // end of frame
+        m_inCompressedFrame = false;
+        const uint64_t length = m_frame.size() >= sizeof(uint64_t)
+                                    ? *reinterpret_cast<const uint64_t *>(m_frame.data()) : 0;
+        if (m_isFrameValid && length + sizeof(uint64_t) == m_frame.size()) {
+            processFrame(m_frameType, m_frame.data() + sizeof(uint64_t), length);
+        } else {
+            qWarning() << "PageInfoReader: received invalid compressed data, discarding data";
             m_mappedRegions.clear();
+        }
+        *frameDone = true;
+    }
+    m_buffer.remove(0, pos + compressedSize);
+    return true;
+}
+
+void PageInfoReader::processFrame(uint32_t frameType, const char *buf, size_t length)
+{
+    if (frameType == DeltaFrame) {
+        if (!applyDelta(buf, length)) {
+            qWarning() << "PageInfoReader: received invalid delta, discarding data";
+            m_mappedRegions.clear();
+        }
+    } else if (!readFullSnapshot(buf, length)) {
+        qWarning() << "PageInfoReader: received invalid snapshot, discarding data";
+        m_mappedRegions.clear();
+    }
+}
+
+// The readers below return false instead of reading past length, so that truncated or corrupt data can't
+// make us read outside of the frame. *pos is always <= length.
+
+// reads count uint32_t values into *values, replacing its contents
+static bool readArray(const char *buf, size_t length, size_t *pos, size_t count, vector<uint32_t> *values)
+{
+    if ((length - *pos) / sizeof(uint32_t) < count) {
+        return false;
+    }
+    const uint32_t *array = reinterpret_cast<const uint32_t *>(buf + *pos);
+    values->assign(array, array + count);
+    *pos += count * sizeof(uint32_t);
+    return true;
+}
+
+// Reads the runs and dense values of a region in the format with runs. The runs must cover the region,
+// and their dense values must exist.
+static bool readRuns(const char *buf, size_t length, size_t *pos, MappedRegion *mr)
+{
+    uint32_t runCount = 0;
+    uint32_t denseCount = 0;
+    if (!readPrimitive(buf, length, pos, &runCount) || !readPrimitive(buf, length, pos, &denseCount) ||
+        (length - *pos) / serializedRunSize < runCount) {
+        return false;
+    }
+    const uint64_t pageCount = mr->pageCount();
+    mr->runs.resize(runCount);
+    uint64_t page = 0;
+    for (PageRun &run : mr->runs) {
+        uint64_t denseIndex = 0;
+        run.firstPage = page;
+        if (!readPrimitive(buf, length, pos, &run.pageCount) || !readPrimitive(buf, length, pos, &denseIndex) ||
+            !readPrimitive(buf, length, pos, &run.useCount) ||
+            !readPrimitive(buf, length, pos, &run.combinedFlags) || run.pageCount > pageCount - page) {
+            return false;
+        }
+        if (denseIndex == ~uint64_t(0)) {
+            run.denseIndex = PageRun::uniformRun;
+        } else if (denseIndex <= denseCount && run.pageCount <= denseCount - denseIndex) {
+            run.denseIndex = size_t(denseIndex);
+        } else {
+            return false;
+        }
+        page += run.pageCount;
+    }
+    return page == pageCount && readArray(buf, length, pos, denseCount, &mr->useCounts) &&
+           readArray(buf, length, pos, denseCount, &mr->combinedFlags);
+}
 
-            const size_t endPos = m_length + sizeof(m_length);
-            const char *buf = m_buffer.constData();
+static bool readMappedRegion(const char *buf, size_t length, size_t *pos, bool withRuns, MappedRegion *mr)
+{
+    uint32_t backingFileLength = 0;
+    if (!readPrimitive(buf, length, pos, &mr->start) || !readPrimitive(buf, length, pos, &mr->end) ||
+        mr->end < mr->start || !readPrimitive(buf, length, pos, &backingFileLength)) {
+        return false;
+    }
+    const size_t paddedLength = (size_t(backingFileLength) + sizeof(uint32_t) - 1) & ~size_t(0x3);
+    if (length - *pos < paddedLength) {
+        return false;
+    }
+    mr->backingFile = std::string(buf + *pos, backingFileLength);
+    *pos += paddedLength;
 
-            for (size_t pos = sizeof(size_t); pos < endPos; ) {
-                MappedRegion mr;
-                mr.start = *reinterpret_cast<const uint64_t *>(buf + pos);
-                pos += sizeof(uint64_t);
-                mr.end = *reinterpret_cast<const uint64_t *>(buf + pos);
-                pos += sizeof(uint64_t);
+    if (withRuns) {
+        return readRuns(buf, length, pos, mr);
+    }
+    const size_t arrayLength = (mr->end - mr->start) / PageInfo::pageSize;
+    if (!readArray(buf, length, pos, arrayLength, &mr->useCounts) ||
+        !readArray(buf, length, pos, arrayLength, &mr->combinedFlags)) {
+        return false;
+    }
+    // the format without runs has the values of all pages, so they form one dense run
+    mr->setAllDense();
+    return true;
+}
 
-                const uint32_t backingFileLength = *reinterpret_cast<const uint32_t *>(buf + pos);
-                pos += sizeof(uint32_t);
-                mr.backingFile = std::string(reinterpret_cast<const char *>(buf + pos), backingFileLength);
-                pos += (backingFileLength + sizeof(uint32_t) - 1) & ~0x3;
+bool PageInfoReader::readFullSnapshot(const char *buf, size_t length)
+{
+    m_mappedRegions.clear();
+    for (size_t pos = 0; pos < length; ) {
+        m_mappedRegions.emplace_back();
+        if (!readMappedRegion(buf, length, &pos, m_hasRuns, &m_mappedRegions.back())) {
+            return false;
+        }
+    }
+    return true;
+}
 
-                const size_t arrayLength = (mr.end - mr.start) / PageInfo::pageSize;
+// The values of pages [firstPage, firstPage + pageCount) in a PatchRegionOp: the use counts, followed by
+// the flags
+struct PagePatch
+{
+    uint64_t firstPage;
+    uint64_t pageCount;
+    const char *values;
+};
 
-                const uint32_t *array = reinterpret_cast<const uint32_t *>(buf + pos);
-                mr.useCounts.assign(array, array + arrayLength);
-                array += arrayLength;
-                mr.combinedFlags.assign(array, array + arrayLength);
-                pos += 2 * arrayLength * sizeof(uint32_t);
+// Writes the values of patches, which are sorted and don't overlap, to the pages of *mr. Regions in the
+// format without runs are one dense run, which is patched in place. Other regions get new runs and values,
+// built in *scratch in one pass, and *scratch gets their old ones to reuse the memory.
+static void applyPatches(const vector<PagePatch> &patches, MappedRegion *mr, MappedRegion *scratch)
+{
+    if (mr->runs.size() == 1 && !mr->runs[0].isUniform()) {
+        const size_t denseIndex = mr->runs[0].denseIndex;
+        for (const PagePatch &patch : patches) {
+            const size_t arraySize = patch.pageCount * sizeof(uint32_t);
+            memcpy(&mr->useCounts[denseIndex + patch.firstPage], patch.values, arraySize);
+            memcpy(&mr->combinedFlags[denseIndex + patch.firstPage], patch.values + arraySize, arraySize);
+        }
+        return;
+    }
 
-                m_mappedRegions.push_back(move(mr));
+    vector<PageRun> &runs = scratch->runs;
+    vector<uint32_t> &useCounts = scratch->useCounts;
+    vector<uint32_t> &combinedFlags = scratch->combinedFlags;
+    runs.clear();
+    useCounts.clear();
+    combinedFlags.clear();
+    uint64_t page = 0;
+    // adjacent runs are merged where possible, so that patching doesn't fragment the runs more and more
+    auto addUniform = [&](uint64_t pageCount, uint32_t useCount, uint32_t flags) {
+        if (!runs.empty() && runs.back().isUniform() && runs.back().useCount == useCount &&
+            runs.back().combinedFlags == flags) {
+            runs.back().pageCount += pageCount;
+        } else {
+            const PageRun run = { page, pageCount, useCount, flags, PageRun::uniformRun };
+            runs.push_back(run);
+        }
+        page += pageCount;
+    };
+    auto addDense = [&](uint64_t pageCount, const void *useCountValues, const void *flagsValues) {
+        if (!pageCount) {
+            return;
+        }
+        const size_t denseIndex = useCounts.size();
+        useCounts.resize(denseIndex + pageCount);
+        combinedFlags.resize(denseIndex + pageCount);
+        memcpy(&useCounts[denseIndex], useCountValues, pageCount * sizeof(uint32_t));
+        memcpy(&combinedFlags[denseIndex], flagsValues, pageCount * sizeof(uint32_t));
+        // the values of the last run are at the end of the arrays
+        if (!runs.empty() && !runs.back().isUniform()) {
+            runs.back().pageCount += pageCount;
+        } else {
+            const PageRun run = { page, pageCount, 0, 0, denseIndex };
+            runs.push_back(run);
+        }
+        page += pageCount;
+    };
+    // adds the old pages from page up to end
+    auto addOld = [&](uint64_t end) {
+        for (size_t r = page < end ? mr->findRun(page) : 0; page < end; r++) {
+            const PageRun &run = mr->runs[r];
+            const uint64_t count = min(run.firstPage + run.pageCount, end) - page;
+            if (run.isUniform()) {
+                addUniform(count, run.useCount, run.combinedFlags);
+            } else {
+                const size_t index = run.denseIndex + (page - run.firstPage);
+                addDense(count, &mr->useCounts[index], &mr->combinedFlags[index]);
             }
+        }
+    };
 
-            m_buffer.remove(0, endPos);
-            m_length = -1;
+    for (const PagePatch &patch : patches) {
+        addOld(patch.firstPage);
+        addDense(patch.pageCount, patch.values, patch.values + patch.pageCount * sizeof(uint32_t));
+    }
+    addOld(mr->pageCount());
+    mr->runs.swap(runs);
+    mr->useCounts.swap(useCounts);
+    mr->combinedFlags.swap(combinedFlags);
+}
+
+bool PageInfoReader::applyDelta(const char *buf, size_t length)
+{
+    // regions from m_mappedRegions are moved, not copied, into the new snapshot and patched there
+    vector<MappedRegion> regions;
+    vector<PagePatch> patches;
+    // a region can only be moved once; after that, it is empty except for start and end
+    vector<bool> isTaken(m_mappedRegions.size(), false);
+    auto take = [&](size_t index) {
+        if (isTaken[index]) {
+            return false;
+        }
+        isTaken[index] = true;
+        return true;
+    };
+    for (size_t pos = 0; pos < length; ) {
+        uint32_t op = 0;
+        if (!readPrimitive(buf, length, &pos, &op)) {
+            return false;
+        }
+        if (op == CopyRegionsOp) {
+            uint32_t first = 0;
+            uint32_t count = 0;
+            if (!readPrimitive(buf, length, &pos, &first) || !readPrimitive(buf, length, &pos, &count) ||
+                size_t(first) + count > m_mappedRegions.size()) {
+                return false;
+            }
+            for (uint32_t i = first; i < first + count; i++) {
+                if (!take(i)) {
+                    return false;
+                }
+                regions.push_back(move(m_mappedRegions[i]));
+            }
+        } else if (op == PatchRegionOp) {
+            uint32_t index = 0;
+            uint32_t patchCount = 0;
+            if (!readPrimitive(buf, length, &pos, &index) || !readPrimitive(buf, length, &pos, &patchCount) ||
+                index >= m_mappedRegions.size() || !take(index)) {
+                return false;
+            }
+            MappedRegion &mr = m_mappedRegions[index];
+            patches.clear();
+            uint64_t patchedEnd = 0;
+            for (uint32_t i = 0; i < patchCount; i++) {
+                uint64_t firstPage = 0;
+                uint64_t pageCount = 0;
+                if (!readPrimitive(buf, length, &pos, &firstPage) ||
+                    !readPrimitive(buf, length, &pos, &pageCount) || firstPage < patchedEnd ||
+                    firstPage > mr.pageCount() || pageCount > mr.pageCount() - firstPage ||
+                    pageCount > (length - pos) / (2 * sizeof(uint32_t))) {
+                    return false;
+                }
+                const PagePatch patch = { firstPage, pageCount, buf + pos };
+                patches.push_back(patch);
+                pos += 2 * pageCount * sizeof(uint32_t);
+                patchedEnd = firstPage + pageCount;
+            }
+            applyPatches(patches, &mr, &m_patchScratch);
+            regions.push_back(move(mr));
+        } else if (op == NewRegionOp) {
+            regions.emplace_back();
+            if (!readMappedRegion(buf, length, &pos, m_hasRuns, &regions.back())) {
+                return false;
+            }
         } else {
-            break;
+            return false;
         }
     }
-    return ret;
+    m_mappedRegions.swap(regions);
+    return true;
+}
+
+// What a tile shows, which determines its color
+enum TileClass : uint8_t {
+    UnknownTile, // present, but none of the below
+    NotSampledTile, // not read in a sampled snapshot
+    NotPresentTile,
+    FileTile,
+    SharedFileTile,
+    HugePageTile,
+    ExclusiveTile,
+    SharedTile,
+    NoPageTile,
+    GapTile, // address space between regions, also at the end of a large region
+    SeparatorTile, // between large regions
+    TileClassCount
+};
+
+// The definition of the classes of pages. Painting doesn't call it, it uses tileClassTable(), which is
+// made from it.
+static TileClass tileClass(uint32_t useCount, uint32_t flags)
+{
+    if (useCount == PageRun::unsampledUseCount) {
+        return NotSampledTile;
+    } else if (!(flags & (1u << 31))) { // TODO no magic numbers - checking if "present" flag clear here
+        return NotPresentTile;
+    } else if ((flags & (1 << KPF_MMAP)) && !(flags & (1 << KPF_ANON))) {
+        return useCount > 1 ? SharedFileTile : FileTile;
+    } else if (flags & (1 << KPF_THP)) {
+        // transparent huge pages, whatever their use count
+        return HugePageTile;
+    } else if (useCount == 1) {
+        return ExclusiveTile;
+    } else if (useCount > 1) {
+        return SharedTile;
+    } else if (flags & (1 << KPF_NOPAGE)) {
+        return NoPageTile;
+    }
+    // qDebug() << "white page has use count" << useCount << "and flags" << printablePageFlags(flags);
+    return UnknownTile;
+}
+
+// Everything that tileClass() looks at, in 7 bits: bits 0-1 are 0, 1 or 2 for a use count of 0, 1 or
+// more, or 3 if not sampled; bits 2-6 are the present, MMAP, ANON, THP and NOPAGE flags.
+static const uint tileClassKeyCount = 128;
+
+static inline uint32_t tileClassKey(uint32_t useCount, uint32_t flags)
+{
+    return ((useCount >= 1) + (useCount >= 2) + (useCount == PageRun::unsampledUseCount)) |
+           ((flags >> (31 - 2)) & (1 << 2)) |
+           ((flags >> (KPF_MMAP - 3)) & (1 << 3)) |
+           ((flags >> (KPF_ANON - 4)) & (1 << 4)) |
+           ((flags >> (KPF_THP - 5)) & (1 << 5)) |
+           ((flags >> (KPF_NOPAGE - 6)) & (1 << 6));
+}
+
+// the TileClass for each key of tileClassKey()
+static const uint8_t *tileClassTable()
+{
+    struct Table
+    {
+        Table()
+        {
+            for (uint32_t key = 0; key < tileClassKeyCount; key++) {
+                const uint32_t useCountKind = key & 3;
+                const uint32_t useCount = useCountKind == 3 ? PageRun::unsampledUseCount : useCountKind;
+                const uint32_t flags = ((key >> 2) & 1) << 31 |
+                                       ((key >> 3) & 1) << KPF_MMAP |
+                                       ((key >> 4) & 1) << KPF_ANON |
+                                       ((key >> 5) & 1) << KPF_THP |
+                                       ((key >> 6) & 1) << KPF_NOPAGE;
+                classes[key] = tileClass(useCount, flags);
+            }
+        }
+        uint8_t classes[tileClassKeyCount];
+    };
+    static const Table table;
+    return table.classes;
+}
+
+#ifdef __SSE2__
+// tileClassKey() of four pages
+static inline __m128i tileClassKeys(const uint32_t *useCounts, const uint32_t *flags)
+{
+    const __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i *>(useCounts));
+    const __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i *>(flags));
+    // the comparisons give -1 for true: 2 - 2 for 0, 2 - 1 for 1, 2 + 1 for not sampled
+    __m128i keys = _mm_add_epi32(_mm_set1_epi32(2),
+                                 _mm_add_epi32(_mm_slli_epi32(_mm_cmpeq_epi32(u, _mm_setzero_si128()), 1),
+                                               _mm_sub_epi32(_mm_cmpeq_epi32(u, _mm_set1_epi32(1)),
+                                                             _mm_cmpeq_epi32(u, _mm_set1_epi32(-1)))));
+    keys = _mm_or_si128(keys, _mm_and_si128(_mm_srli_epi32(f, 31 - 2), _mm_set1_epi32(1 << 2)));
+    keys = _mm_or_si128(keys, _mm_and_si128(_mm_srli_epi32(f, KPF_MMAP - 3), _mm_set1_epi32(1 << 3)));
+    keys = _mm_or_si128(keys, _mm_and_si128(_mm_srli_epi32(f, KPF_ANON - 4), _mm_set1_epi32(1 << 4)));
+    keys = _mm_or_si128(keys, _mm_and_si128(_mm_srli_epi32(f, KPF_THP - 5), _mm_set1_epi32(1 << 5)));
+    return _mm_or_si128(keys, _mm_and_si128(_mm_srli_epi32(f, KPF_NOPAGE - 6), _mm_set1_epi32(1 << 6)));
+}
+#endif
+
+// Sets classes to the TileClass of count pages of a dense run. Computing the keys without branches
+// (with SSE2 on x86-64) and looking them up is about five times as fast as tileClass().
+static void classifyPages(const uint32_t *useCounts, const uint32_t *flags, size_t count, uint8_t *classes)
+{
+    const uint8_t *table = tileClassTable();
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= count; i += 16) {
+        const __m128i keys01 = _mm_packs_epi32(tileClassKeys(useCounts + i, flags + i),
+                                               tileClassKeys(useCounts + i + 4, flags + i + 4));
+        const __m128i keys23 = _mm_packs_epi32(tileClassKeys(useCounts + i + 8, flags + i + 8),
+                                               tileClassKeys(useCounts + i + 12, flags + i + 12));
+        alignas(16) uint8_t keys[16];
+        _mm_store_si128(reinterpret_cast<__m128i *>(keys), _mm_packus_epi16(keys01, keys23));
+        for (size_t j = 0; j < 16; j++) {
+            classes[i + j] = table[keys[j]];
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        classes[i] = table[tileClassKey(useCounts[i], flags[i])];
+    }
+}
+
+// A color scheme is just a color for each TileClass, so painting works the same for all of them
+static const QRgb *tileColors(MosaicWidget::ColorScheme scheme)
+{
+    // don't always construct QColors from enums - this would eat ~ 10% or so of frame time.
+    static const QRgb defaultColors[TileClassCount] = {
+        QColor(Qt::white).rgb(),
+        QColor(Qt::lightGray).rgb(),
+        QColor(Qt::darkGray).rgb(),
+        QColor(Qt::darkGreen).rgb(),
+        QColor(Qt::green).rgb(),
+        QColor(Qt::magenta).lighter(150).rgb(),
+        QColor(Qt::magenta).rgb(),
+        QColor(Qt::yellow).rgb(),
+        QColor(Qt::darkRed).rgb(),
+        QColor(Qt::blue).rgb(),
+        QColor(Qt::black).rgb()
+    };
+    // based on the palette by Okabe and Ito, which works with all common kinds of color blindness
+    static const QRgb colorBlindColors[TileClassCount] = {
+        0xffffffff, // white
+        0xffd0d0d0, // light gray
+        0xff707070, // dark gray
+        0xff0072b2, // blue
+        0xff56b4e9, // sky blue
+        0xffcc79a7, // reddish purple
+        0xffd55e00, // vermillion
+        0xfff0e442, // yellow
+        0xffe69f00, // orange
+        0xff009e73, // bluish green
+        0xff000000 // black
+    };
+    return scheme == MosaicWidget::ColorBlindColors ? colorBlindColors : defaultColors;
 }
 
 // bypass QImage API to save cycles; it does make a difference.
@@ -167,127 +681,231 @@ public:
          m_height(height),
          m_buffer(reinterpret_cast<quint32 *>(buffer))
     {}
-    inline quint32 pixel(int x, int y) const { return m_buffer[y * m_width + x]; }
-    inline void setPixel(int x, int y, quint32 value) { m_buffer[y * m_width + x] = value | (0xff << 24); }
+    inline quint32 *line(int y) { return m_buffer + y * m_width; }
+
+    // paints the tiles [firstColumn, endColumn) of tile row y in the colors of their classes
+    void paintTiles(uint pixelsPerTile, uint y, const uint8_t *classes, uint firstColumn, uint endColumn,
+                    const QRgb *colors);
 
 private:
+    // with the tile size known at compile time, the compiler unrolls and vectorizes the fills
+    template<uint pixelsPerTile>
+    void paintTiles(uint y, const uint8_t *classes, uint firstColumn, uint endColumn, const QRgb *colors);
+
     const int m_width;
     const int m_height;
     quint32 *const m_buffer;
 };
 
-class ColorCache
+void Rgb32PixelAccess::paintTiles(uint pixelsPerTile, uint y, const uint8_t *classes, uint firstColumn,
+                                  uint endColumn, const QRgb *colors)
 {
-public:
-    ColorCache()
-       : m_cachedColor(0)
-    {
-        for (uint i = 0; i < s_pixelsPerTile * s_pixelsPerTile; i++) {
-            m_colorCache[i] = 0;
-        }
+    switch (pixelsPerTile) {
+    case 1:
+        paintTiles<1>(y, classes, firstColumn, endColumn, colors);
+        break;
+    case 2:
+        paintTiles<2>(y, classes, firstColumn, endColumn, colors);
+        break;
+    case 4:
+        paintTiles<4>(y, classes, firstColumn, endColumn, colors);
+        break;
+    case 8:
+        paintTiles<8>(y, classes, firstColumn, endColumn, colors);
+        break;
+    default:
+        assert(false);
     }
+}
 
-    void paintTile(Rgb32PixelAccess *img, uint x, uint y, uint tileSize, const QColor &color);
-
-private:
-    // QColor::darker() is fairly slow, so memoize the result
-    void maybeUpdateColors(const QColor &color);
+template<uint pixelsPerTile>
+void Rgb32PixelAccess::paintTiles(uint y, const uint8_t *classes, uint firstColumn, uint endColumn,
+                                  const QRgb *colors)
+{
+    quint32 *const firstLine = line(y * pixelsPerTile) + firstColumn * pixelsPerTile;
+    quint32 *pixel = firstLine;
+    for (uint x = firstColumn; x < endColumn; x++) {
+        const quint32 color = colors[classes[x]];
+        for (uint i = 0; i < pixelsPerTile; i++) {
+            *pixel++ = color;
+        }
+    }
+    // the other lines of the tiles are the same
+    for (uint i = 1; i < pixelsPerTile; i++) {
+        memcpy(line(y * pixelsPerTile + i) + firstColumn * pixelsPerTile, firstLine,
+               (pixel - firstLine) * sizeof(quint32));
+    }
+}
 
-    uint m_cachedColor;
-    uint m_colorCache[s_pixelsPerTile * s_pixelsPerTile];
-};
+SnapshotCollector::SnapshotCollector(uint pid, const PageInfo::Options &options)
+   : m_pageCollector(pid, options),
+     m_writeIndex(0),
+     m_readIndex(1),
+     m_latest(2)
+{
+}
 
-void ColorCache::maybeUpdateColors(const QColor &color)
+vector<MappedRegion> *SnapshotCollector::takeSnapshot()
 {
-    if (color.rgb() == m_cachedColor) {
-        return;
-    }
-    m_cachedColor = color.rgb();
-    QColor c = color;
-    for (uint i = 0; i < s_pixelsPerTile * s_pixelsPerTile; i++) {
-        m_colorCache[i] = c.rgb();
-        c = c.darker(115);
+    // only the collector thread sets freshFlag, so if it is set here, it is also set in the exchange
+    if (!(m_latest.load() & freshFlag)) {
+        return nullptr;
     }
+    m_readIndex = m_latest.exchange(m_readIndex) & ~freshFlag;
+    return &m_buffers[m_readIndex];
 }
 
-void ColorCache::paintTile(Rgb32PixelAccess *img, uint x, uint y, uint tileSize, const QColor &color)
+void SnapshotCollector::collect()
 {
-    maybeUpdateColors(color);
-    const uint yStart = y * tileSize;
-    const uint xEnd = (x + 1) * tileSize;
-    const uint yEnd = (y + 1) * tileSize;
-    uint colorIndex = 0;
-    for (x = x * tileSize ; x < xEnd; x++) {
-        for (y = yStart ; y < yEnd; y++) {
-            img->setPixel(x, y, m_colorCache[colorIndex]);
-        }
+    QElapsedTimer collectTime;
+    collectTime.start();
+    // PageCollector reuses the memory of its snapshots, so copy this one out - into a buffer with an
+    // older snapshot, whose memory is mostly reused in turn
+    m_buffers[m_writeIndex] = m_pageCollector.collect().mappedRegions();
+    const unsigned int previous = m_latest.exchange(m_writeIndex | freshFlag);
+    m_writeIndex = previous & ~freshFlag;
+    // if the previous snapshot was not taken, it is dropped now, and its snapshotReady() is still pending
+    if (!(previous & freshFlag)) {
+        emit snapshotReady();
     }
+    QTimer::singleShot(max(0, s_updateInterval - int(collectTime.elapsed())), this, SLOT(collect()));
 }
 
-MosaicWidget::MosaicWidget(uint pid)
-   : m_pid(pid)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+MosaicWidget::MosaicWidget(uint pid, const PageInfo::Options &options)
+   : m_pid(pid),
+     m_snapshotCollector(new SnapshotCollector(pid, options)),
+     m_rowCount(0),
+     m_imgFirstRow(0),
+     m_imgEndRow(0),
+     m_isImgValid(false),
+     m_tileColors(tileColors(DefaultColors)),
+     m_pixelsPerTile(s_defaultPixelsPerTile),
+     m_bandPool(max(1u, thread::hardware_concurrency()))
 {
     qDebug() << "local process";
     m_updateIntervalWatch.start();
-    // we're not usually *reaching* 50 milliseconds update interval... but trying doesn't hurt.
-    m_updateTimer.setInterval(50);
-    connect(&m_updateTimer, SIGNAL(timeout()), SLOT(localUpdateTimeout()));
-    m_updateTimer.start();
-    localUpdateTimeout();
-
-    m_mosaicWidget.installEventFilter(this);
-    setWidget(&m_mosaicWidget);
+    m_snapshotCollector->moveToThread(&m_collectorThread);
+    connect(&m_collectorThread, SIGNAL(started()), m_snapshotCollector.get(), SLOT(collect()));
+    connect(m_snapshotCollector.get(), SIGNAL(snapshotReady()), SLOT(localSnapshotReady()));
+    m_collectorThread.start();
 }
 
 MosaicWidget::MosaicWidget(const QByteArray &host, uint port)
-   : m_pid(0)
+   : m_pid(0),
+     m_rowCount(0),
+     m_imgFirstRow(0),
+     m_imgEndRow(0),
+     m_isImgValid(false),
+     m_tileColors(tileColors(DefaultColors)),
+     m_pixelsPerTile(s_defaultPixelsPerTile),
+     m_bandPool(max(1u, thread::hardware_concurrency()))
 {
     qDebug() << "process on server:" << host << port;
+    connect(&m_socket, SIGNAL(connected()), SLOT(socketConnected()));
     connect(&m_socket, SIGNAL(readyRead()), SLOT(networkDataAvailable()));
     connect(&m_socket, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(socketError()));
-    m_socket.connectToHost(QString::fromLatin1(host), port, QIODevice::ReadOnly);
+    m_socket.connectToHost(QString::fromLatin1(host), port);
+}
+
+MosaicWidget::~MosaicWidget()
+{
+    // a snapshot in progress is finished first, the collector must not go away under it
+    m_collectorThread.quit();
+    m_collectorThread.wait();
+}
+
+void MosaicWidget::setColorScheme(ColorScheme scheme)
+{
+    m_tileColors = tileColors(scheme);
+    m_isImgValid = false;
+    viewport()->update();
+}
 
-    setWidget(&m_mosaicWidget);
+void MosaicWidget::setPixelsPerTile(uint pixelsPerTile)
+{
+    pixelsPerTile = qBound(s_minPixelsPerTile, pixelsPerTile, s_maxPixelsPerTile);
+    // round down to a power of two
+    while (pixelsPerTile & (pixelsPerTile - 1)) {
+        pixelsPerTile &= pixelsPerTile - 1;
+    }
+    if (pixelsPerTile == m_pixelsPerTile) {
+        return;
+    }
+    // keep the tile at the top left of the viewport where it is
+    const int x = horizontalScrollBar()->value() / int(m_pixelsPerTile) * int(pixelsPerTile);
+    const int y = verticalScrollBar()->value() / int(m_pixelsPerTile) * int(pixelsPerTile);
+    m_pixelsPerTile = pixelsPerTile;
+    m_isImgValid = false;
+    updateScrollBars();
+    horizontalScrollBar()->setValue(x);
+    verticalScrollBar()->setValue(y);
+    viewport()->update();
+}
+
+void MosaicWidget::zoomIn()
+{
+    setPixelsPerTile(m_pixelsPerTile * 2);
+}
+
+void MosaicWidget::zoomOut()
+{
+    setPixelsPerTile(m_pixelsPerTile / 2);
 }
 
-void MosaicWidget::localUpdateTimeout()
+void MosaicWidget::localSnapshotReady()
 {
-    PageInfo pageInfo(m_pid);
-    if (!pageInfo.mappedRegions().empty()) {
-        updatePageInfo(pageInfo.mappedRegions());
+    vector<MappedRegion> *snapshot = m_snapshotCollector->takeSnapshot();
+    if (!snapshot) {
+        return;
+    }
+    if (!snapshot->empty()) {
+        // the old regions go to the collector thread, which reuses their memory
+        m_regions.swap(*snapshot);
+        updatePageInfo();
     } else {
         emit showPageInfo(0, 0, QString());
-        // HACK: not stopping the timer because clients expect to get regular updates, most importantly
-        //       they expect that missing the first update is not critical
-        // m_updateTimer.stop();
-        return;
+        // HACK: not stopping the collector because clients expect to get regular updates, most
+        //       importantly they expect that missing the first update is not critical
     }
 }
 
 void MosaicWidget::networkDataAvailable()
 {
     if (m_pageInfoReader.addData(m_socket.readAll())) {
-        updatePageInfo(m_pageInfoReader.m_mappedRegions);
+        m_regions = m_pageInfoReader.m_mappedRegions;
+        updatePageInfo();
     }
 }
 
+void MosaicWidget::socketConnected()
+{
+    m_socket.write(PageInfoReader::protocolHello());
+}
+
 void MosaicWidget::socketError()
 {
     emit serverConnectionBroke(m_regions.size());
 }
 
-void MosaicWidget::updatePageInfo(const vector<MappedRegion> &regions)
+void MosaicWidget::updatePageInfo()
 {
     //qint64 elapsed = m_updateIntervalWatch.restart();
     //qDebug() << " >> frame interval" << elapsed << "milliseconds";
 
-    m_regions = regions;
-    m_largeRegions.clear();
+    const vector<MappedRegion> &regions = m_regions;
+    // if the layout stays the same, only the tiles that changed need to be repainted
+    vector<LargeRegion> previousLargeRegions;
+    previousLargeRegions.swap(m_largeRegions);
+    const quint32 previousRowCount = m_rowCount;
+    m_rowCount = 0;
 
     if (regions.empty()) {
+        m_isImgValid = false;
         m_img = QImage();
-        m_mosaicWidget.setPixmap(QPixmap::fromImage(m_img));
-        m_mosaicWidget.adjustSize();
+        updateScrollBars();
+        viewport()->update();
         return;
     }
 #ifndef NDEBUG
@@ -306,187 +924,271 @@ void MosaicWidget::updatePageInfo(const vector<MappedRegion> &regions)
         assert(regions[i].start >= regions[i - 1].end);
     }
 
-    //const quint64 totalRange = regions.back().end - regions.front().start;
-    //qDebug() << "Address range covered (in pages) is" << totalRange / PageInfo::pageSize;
-
-    quint64 mappedSpace = 0;
-    for (const MappedRegion &r : regions) {
-        mappedSpace += r.end - r.start;
-    }
-    //qDebug() << "Number of pages in mapped address space (VSZ) is" << mappedSpace / PageInfo::pageSize;
-
     // The difference between page count in mapped address space and page count in the "spanned" address
     // space can be HUGE, so we must figuratively insert some (...) in the graphical representation. Find
     // the large contiguous regions and thus the points to graphically separate them.
     // TODO implement a separator later, be it a line, spacing, labeling....
-    vector<pair<quint64, quint64>> largeRegions;
-    {
-        pair<quint64, quint64> largeRegion = make_pair(regions.front().start, regions.front().end);
-        static const quint64 maxAllowedGap = 64 * PageInfo::pageSize;
-        for (const MappedRegion &r : regions) {
-            if (r.start > largeRegion.second + maxAllowedGap) {
-                largeRegions.push_back(largeRegion);
-                largeRegion.first = r.start;
-            }
-            largeRegion.second = r.end;
+    static const quint64 maxAllowedGap = 64 * PageInfo::pageSize;
+    LargeRegion largeRegion = { 0, regions.front().start, regions.front().end };
+    auto addLargeRegion = [this](const LargeRegion &largeRegion) {
+        m_largeRegions.push_back(largeRegion);
+        m_rowCount += ((largeRegion.end - largeRegion.start) / PageInfo::pageSize + (s_columnCount - 1)) /
+                      s_columnCount;
+    };
+    for (const MappedRegion &r : regions) {
+        if (r.start > largeRegion.end + maxAllowedGap) {
+            addLargeRegion(largeRegion);
+            m_rowCount += s_tilesPerSeparator;
+            largeRegion.firstRow = m_rowCount;
+            largeRegion.start = r.start;
         }
-        largeRegions.push_back(largeRegion);
+        largeRegion.end = r.end;
     }
+    addLargeRegion(largeRegion);
+    //qDebug() << "row count is" << m_rowCount << " largeRegion count is" << m_largeRegions.size();
 
-#if 0
-    // for performance tuning...
-    qDebug() << "number of large regions in the address space is" << largeRegions.size();
-    for (auto &r : largeRegions) {
-        // hex output...
-        qDebug() << "region" << QString("%1").arg(r.first, 0, 16) << QString("%1").arg(r.second, 0, 16);
+    updateScrollBars();
+    if (m_isImgValid && m_rowCount == previousRowCount && m_largeRegions == previousLargeRegions) {
+        repaintChangedTiles();
+    } else {
+        m_isImgValid = false;
+        viewport()->update();
     }
-#endif
+}
 
-    static const uint tilesPerSeparator = 2;
+void MosaicWidget::updateScrollBars()
+{
+    const int contentWidth = s_columnCount * m_pixelsPerTile;
+    const int contentHeight = m_rowCount * m_pixelsPerTile;
+    const QSize viewportSize = viewport()->size();
+    horizontalScrollBar()->setRange(0, qMax(0, contentWidth - viewportSize.width()));
+    horizontalScrollBar()->setPageStep(viewportSize.width());
+    horizontalScrollBar()->setSingleStep(m_pixelsPerTile * 4);
+    verticalScrollBar()->setRange(0, qMax(0, contentHeight - viewportSize.height()));
+    verticalScrollBar()->setPageStep(viewportSize.height());
+    verticalScrollBar()->setSingleStep(m_pixelsPerTile * 4);
+}
 
-    // determine size
-    // separators between largeRegions
-    uint rowCount = (largeRegions.size() - 1) * tilesPerSeparator;
-    // space for tiles showing showing pages (corresponding to contents of largeRegions)
-    for (pair<quint64, quint64> largeRegion : largeRegions) {
-        rowCount += ((largeRegion.second - largeRegion.first) / PageInfo::pageSize + (s_columnCount - 1)) /
-                    s_columnCount;
-    }
-    //qDebug() << "row count is" << rowCount << " largeRegion count is" << largeRegions.size();
+// Calls work(bandFirst, bandEnd) for bands of rows that partition [firstRow, endRow), on the threads of
+// pool if there are enough rows. The calling thread takes the last band.
+template<typename Work>
+static void forEachBand(WorkerPool *pool, quint32 firstRow, quint32 endRow, Work work)
+{
+    const quint32 rowCount = endRow - firstRow;
+    const quint32 bandCount = max(1u, min(rowCount / s_minBandRows, pool->threadCount()));
+    pool->run(bandCount, [&](unsigned int band) {
+        work(firstRow + quint32(quint64(rowCount) * band / bandCount),
+             firstRow + quint32(quint64(rowCount) * (band + 1) / bandCount));
+    });
+}
 
-    // paint!
+void MosaicWidget::classifyRows(quint32 firstRow, quint32 endRow, uint8_t *classes) const
+{
+    if (firstRow == endRow) {
+        return;
+    }
+    // the large region containing the row, or the last one before it
+    auto largeRegion = upper_bound(m_largeRegions.begin(), m_largeRegions.end(), firstRow,
+                                   [](quint32 lhs, const LargeRegion &rhs) { return lhs < rhs.firstRow; }) - 1;
+    // the first region that ends after the start of the row
+    auto region = m_regions.cbegin();
+    const uint8_t *const classTable = tileClassTable();
+    for (quint32 row = firstRow; row < endRow; row++) {
+        uint8_t *const rowClasses = classes + size_t(row - firstRow) * s_columnCount;
+        while (largeRegion + 1 != m_largeRegions.end() && (largeRegion + 1)->firstRow <= row) {
+            ++largeRegion;
+        }
+        const quint64 rowStart = largeRegion->start +
+                                 quint64(row - largeRegion->firstRow) * s_columnCount * PageInfo::pageSize;
+        if (rowStart >= largeRegion->end) {
+            // separator after a large region
+            memset(rowClasses, SeparatorTile, s_columnCount);
+            continue;
+        }
+        // the rest of the last row of a large region is empty, like the gaps between regions
+        const quint64 rowEnd = qMin(rowStart + s_columnCount * PageInfo::pageSize, largeRegion->end);
+        if (region == m_regions.cend() || region->end <= rowStart || region->start > rowStart) {
+            region = upper_bound(m_regions.cbegin(), m_regions.cend(), rowStart,
+                                 [](quint64 lhs, const MappedRegion &rhs) { return lhs < rhs.end; });
+        }
 
-    m_img = QImage(s_columnCount * s_pixelsPerTile, rowCount * s_pixelsPerTile, QImage::Format_RGB32);
-    // Theoretically we need to get the stride of the image, but in practice it is equal to width,
-    // especially with the power-of-2 widths we are using.
-    Rgb32PixelAccess pixels(m_img.width(), m_img.height(), m_img.bits());
-    // don't always construct QColors from enums - this would eat ~ 10% or so of frame time.
-    const QColor colorWhite(Qt::white);
-    const QColor colorGray(Qt::darkGray);
-    const QColor colorMagenta(Qt::magenta);
-    const QColor colorMagentaLight = QColor(Qt::magenta).lighter(150);
-    const QColor colorYellow(Qt::yellow);
-    const QColor colorCyan(Qt::blue);
-    const QColor colorGreen(Qt::green);
-    const QColor colorGreenDark(Qt::darkGreen);
-    const QColor colorRedDark(Qt::darkRed);
-    const QColor colorBlack(Qt::black);
-    // cache results of QColor::darken()
-    ColorCache cc;
-
-    uint row = 0;
-    size_t iMappedRegion = 0;
-    for (pair<quint64, quint64> largeRegion : largeRegions) {
         uint column = 0;
-        assert(iMappedRegion < regions.size());
-        const MappedRegion *region = &regions[iMappedRegion];
-
-        m_largeRegions.push_back(make_pair(row, region->start));
-
-        for ( ;region->end <= largeRegion.second; region = &regions[iMappedRegion]) {
-            assert(iMappedRegion < regions.size());
-            assert(region->end >= region->start);
-
-            size_t iPage = 0;
-            while (iPage < region->useCounts.size()) {
-                const size_t endColumn = qMin(column + region->useCounts.size() - iPage, size_t(s_columnCount));
-                //qDebug() << "painting region" << column << endColumn;
-                for ( ; column < endColumn; column++, iPage++) {
-                    //qDebug() << "magenta" << column << row;
-                    QColor color = colorWhite;
-                    if (!(region->combinedFlags[iPage] & (1 << 31))) { // TODO no magic numbers - checking if "present" flag clear here
-                        color = colorGray;
-                    } else if ((region->combinedFlags[iPage] & (1 << KPF_MMAP)) &&
-                               !(region->combinedFlags[iPage] & (1 << KPF_ANON))) {
-                        color = region->useCounts[iPage] > 1 ? colorGreen : colorGreenDark;
-                    } else if (region->combinedFlags[iPage] & (1 << KPF_THP)) {
-                        // THP implies use count 1; the kernel wrongly reports use count 0 in this case
-                        color = colorMagentaLight;
-                    } else if (region->useCounts[iPage] == 1) {
-                        color = colorMagenta;
-                    } else if (region->useCounts[iPage] > 1) {
-                        color = colorYellow;
-                    } else if (region->combinedFlags[iPage] & (1 << KPF_NOPAGE)) {
-                        color = colorRedDark;
-                    } else {
-                        // qDebug() << "white page has use count" << region->useCounts[iPage] << "and flags"
-                        //          << printablePageFlags(region->combinedFlags[iPage]);
-                    }
-                    cc.paintTile(&pixels, column, row, s_pixelsPerTile, color);
-                }
-                if (column == s_columnCount) {
-                    column = 0;
-                    row++;
-                }
+        auto setTiles = [&](uint endColumn, TileClass tileClass) {
+            if (endColumn > column) {
+                memset(rowClasses + column, tileClass, endColumn - column);
+                column = endColumn;
             }
-            assert(region->start + iPage * PageInfo::pageSize == region->end);
-
-            // fill tiles up to either next MappedRegion or (if at end of current largeRegion) end of row
-
-            // why increase it here? a) convenience, otherwise there'd be a lot of "iMappedRegion + 1" below
-            // b) correctness, we need to fill up the current row if we're at end of region. this could be
-            //    done differently, but i don't think it's worth it if you think about how to do it.
-            iMappedRegion++;
-
-            assert(column <= s_columnCount);
-            size_t gapPages = column ? (s_columnCount - column) : 0;
-            if (iMappedRegion < regions.size() && regions[iMappedRegion].start < largeRegion.second) {
-                //qDebug() << "doing it..." << QString("%1").arg(region->end, 0, 16)
-                //                          << QString("%1").arg(regions[iMappedRegion].start, 0, 16);
-                assert(regions[iMappedRegion].start >= region->end);
-                // region still points to previous MappedRegion...
-                gapPages = (regions[iMappedRegion].start - region->end) / PageInfo::pageSize;
+        };
+        for (auto r = region; r != m_regions.cend() && r->start < rowEnd; ++r) {
+            // a gap before the region
+            setTiles((max<uint64_t>(r->start, rowStart) - rowStart) / PageInfo::pageSize, GapTile);
+            const quint64 firstPage = r->start < rowStart ? (rowStart - r->start) / PageInfo::pageSize : 0;
+            if (firstPage >= r->pageCount()) {
+                continue;
             }
-            assert(gapPages < s_columnCount);
-            while (gapPages) {
-                const size_t endColumn = qMin(size_t(s_columnCount), column + gapPages);
-                gapPages -= (endColumn - column);
-                //qDebug() << "painting gap" << column << endColumn << gapPages;
-                for ( ; column < endColumn; column++) {
-                    cc.paintTile(&pixels, column, row, s_pixelsPerTile, colorCyan);
-                }
-                if (column == s_columnCount) {
-                    column = 0;
-                    row++;
+            for (size_t i = r->findRun(firstPage); i < r->runs.size() && column < s_columnCount; i++) {
+                const PageRun &run = r->runs[i];
+                const quint64 page = max<uint64_t>(run.firstPage, firstPage);
+                const uint count = uint(min<uint64_t>(run.firstPage + run.pageCount - page,
+                                                      s_columnCount - column));
+                if (run.isUniform()) {
+                    // all pages of a uniform run, e.g. a large unpopulated area, are in the same class
+                    setTiles(column + count, TileClass(classTable[tileClassKey(run.useCount,
+                                                                               run.combinedFlags)]));
+                } else {
+                    const size_t index = run.denseIndex + (page - run.firstPage);
+                    classifyPages(&r->useCounts[index], &r->combinedFlags[index], count, rowClasses + column);
+                    column += count;
                 }
             }
+        }
+        setTiles(s_columnCount, GapTile);
+    }
+}
 
-            assert(region->end <= largeRegion.second);
-            // loop control snippet "region = &regions[iMappedRegion]" would access out of bounds otherwise
-            if (iMappedRegion >= regions.size()) {
-                break;
-            }
+void MosaicWidget::renderRows(quint32 firstRow, quint32 endRow)
+{
+    const int width = s_columnCount * m_pixelsPerTile;
+    const int height = (endRow - firstRow) * m_pixelsPerTile;
+    if (m_img.width() != width || m_img.height() != height) {
+        m_img = QImage(width, height, QImage::Format_RGB32);
+    }
+    m_imgFirstRow = firstRow;
+    m_imgEndRow = endRow;
+    m_isImgValid = true;
+    m_tileClasses.resize(size_t(endRow - firstRow) * s_columnCount);
+    if (!height) {
+        return;
+    }
+
+    // Theoretically we need to get the stride of the image, but in practice it is equal to width,
+    // especially with the power-of-2 widths we are using.
+    Rgb32PixelAccess pixels(m_img.width(), m_img.height(), m_img.bits());
+    // rows don't depend on each other, and the bands write to separate parts of the image
+    forEachBand(&m_bandPool, 0, endRow - firstRow, [&](quint32 bandFirst, quint32 bandEnd) {
+        classifyRows(firstRow + bandFirst, firstRow + bandEnd,
+                     &m_tileClasses[size_t(bandFirst) * s_columnCount]);
+        for (quint32 y = bandFirst; y < bandEnd; y++) {
+            pixels.paintTiles(m_pixelsPerTile, y, &m_tileClasses[size_t(y) * s_columnCount], 0, s_columnCount,
+                              m_tileColors);
+        }
+    });
+}
+
+void MosaicWidget::repaintChangedTiles()
+{
+    m_newTileClasses.resize(m_tileClasses.size());
+    forEachBand(&m_bandPool, m_imgFirstRow, m_imgEndRow, [this](quint32 bandFirst, quint32 bandEnd) {
+        classifyRows(bandFirst, bandEnd,
+                     &m_newTileClasses[size_t(bandFirst - m_imgFirstRow) * s_columnCount]);
+    });
+    Rgb32PixelAccess pixels(m_img.width(), m_img.height(), m_img.bits());
+    const int scrollX = horizontalScrollBar()->value();
+    const int scrollY = verticalScrollBar()->value();
+    for (quint32 y = 0; y < m_imgEndRow - m_imgFirstRow; y++) {
+        const uint8_t *oldClasses = &m_tileClasses[size_t(y) * s_columnCount];
+        const uint8_t *newClasses = &m_newTileClasses[size_t(y) * s_columnCount];
+        // usually, most rows have not changed, and memcmp() is very fast at finding that out
+        if (!memcmp(oldClasses, newClasses, s_columnCount)) {
+            continue;
         }
-        assert(column == 0);
-        // draw separator line; we avoid a line after the last largeRegion via the "&& y < rowCount"
-        // condition and decreasing rowCount by the height (thickness) of a line.
-        for (uint y = row; y < row + tilesPerSeparator && y < rowCount; y++) {
-            for (uint x = 0 ; x < s_columnCount; x++) {
-                cc.paintTile(&pixels, x, y, s_pixelsPerTile, colorBlack);
+        uint firstChanged = s_columnCount;
+        uint endChanged = 0;
+        for (uint x = 0; x < s_columnCount; x++) {
+            if (oldClasses[x] != newClasses[x]) {
+                firstChanged = qMin(firstChanged, x);
+                endChanged = x + 1;
             }
         }
-        row += tilesPerSeparator;
+        pixels.paintTiles(m_pixelsPerTile, y, newClasses, firstChanged, endChanged, m_tileColors);
+        // Qt collects these and repaints them together
+        viewport()->update(QRect(firstChanged * m_pixelsPerTile - scrollX,
+                                 (m_imgFirstRow + y) * m_pixelsPerTile - scrollY,
+                                 (endChanged - firstChanged) * m_pixelsPerTile, m_pixelsPerTile));
     }
+    m_tileClasses.swap(m_newTileClasses);
+}
 
-    m_mosaicWidget.setPixmap(QPixmap::fromImage(m_img));
-    m_mosaicWidget.adjustSize();
+QSize MosaicWidget::sizeHint() const
+{
+    // like QScrollArea with a large widget
+    const int h = fontMetrics().height();
+    return QSize(36 * h, 24 * h);
 }
 
-void MosaicWidget::printPageFlagsAtPos(const QPoint &widgetPos)
+void MosaicWidget::paintEvent(QPaintEvent *)
 {
-    printPageFlagsAtAddr(addressAtPos(widgetPos));
+    if (!m_rowCount) {
+        return;
+    }
+    const int x = horizontalScrollBar()->value();
+    const int y = verticalScrollBar()->value();
+    const quint32 firstVisibleRow = y / m_pixelsPerTile;
+    const quint32 endVisibleRow = qMin(m_rowCount, (y + viewport()->height() + m_pixelsPerTile - 1) /
+                                                   m_pixelsPerTile);
+    if (!m_isImgValid || firstVisibleRow < m_imgFirstRow || endVisibleRow > m_imgEndRow) {
+        // with some margin, scrolling a little does not need to render anything
+        renderRows(firstVisibleRow - qMin(firstVisibleRow, s_marginRows),
+                   qMin(m_rowCount, endVisibleRow + s_marginRows));
+    }
+    QPainter painter(viewport());
+    painter.drawImage(-x, m_imgFirstRow * m_pixelsPerTile - y, m_img);
+}
+
+void MosaicWidget::resizeEvent(QResizeEvent *)
+{
+    updateScrollBars();
+}
+
+void MosaicWidget::scrollContentsBy(int, int)
+{
+    viewport()->update();
 }
 
-quint64 MosaicWidget::addressAtPos(const QPoint &widgetPos)
+void MosaicWidget::wheelEvent(QWheelEvent *event)
 {
-    // widgetPos can be outside of the widget when the mouse button goes down inside the widget rect,
-    // the with button still down is moved outside the widget. Like a drag, but we don't implement DnD.
-    quint32 row = qMax(0, widgetPos.y()) / s_pixelsPerTile;
-    quint32 column = qBound(0, widgetPos.x() / int(s_pixelsPerTile), int(s_columnCount));
+    if (event->modifiers() & Qt::ControlModifier) {
+        if (event->angleDelta().y() > 0) {
+            zoomIn();
+        } else if (event->angleDelta().y() < 0) {
+            zoomOut();
+        }
+        event->accept();
+        return;
+    }
+    QAbstractScrollArea::wheelEvent(event);
+}
+
+void MosaicWidget::mousePressEvent(QMouseEvent *event)
+{
+    if (event->buttons() & Qt::LeftButton) {
+        printPageFlagsAtPos(event->pos());
+    }
+}
+
+void MosaicWidget::mouseMoveEvent(QMouseEvent *event)
+{
+    if (event->buttons() & Qt::LeftButton) {
+        printPageFlagsAtPos(event->pos());
+    }
+}
+
+void MosaicWidget::printPageFlagsAtPos(const QPoint &pos)
+{
+    printPageFlagsAtAddr(addressAtPos(QPoint(pos.x() + horizontalScrollBar()->value(),
+                                             pos.y() + verticalScrollBar()->value())));
+}
+
+quint64 MosaicWidget::addressAtPos(const QPoint &pos)
+{
+    // pos can be outside of the viewport when the mouse button goes down inside of it, and the mouse is
+    // then moved outside with the button still down. Like a drag, but we don't implement DnD.
+    quint32 row = qMax(0, pos.y()) / m_pixelsPerTile;
+    quint32 column = qBound(0, pos.x() / int(m_pixelsPerTile), int(s_columnCount) - 1);
 
     auto lIt = upper_bound(m_largeRegions.begin(), m_largeRegions.end(), row,
-                           [](quint32 lhs, const pair<quint32, quint64> &rhs)
-                               { return lhs < rhs.first; });
+                           [](quint32 lhs, const LargeRegion &rhs)
+                               { return lhs < rhs.firstRow; });
     if (lIt == m_largeRegions.begin()) {
         // qDebug() << "out of range (row too small)";
         return 0;
@@ -494,7 +1196,7 @@ quint64 MosaicWidget::addressAtPos(const QPoint &widgetPos)
     --lIt; // now lIt is at the next less or equal element
            // (unless row > last row, which should not trip up callers)
 
-    return lIt->second + ((row - lIt->first) * s_columnCount + column) * PageInfo::pageSize;
+    return lIt->start + ((row - lIt->firstRow) * s_columnCount + column) * PageInfo::pageSize;
 }
 
 void MosaicWidget::printPageFlagsAtAddr(quint64 addr)
@@ -521,18 +1223,7 @@ void MosaicWidget::printPageFlagsAtAddr(quint64 addr)
 
     const size_t index = (addr - rIt->start) / PageInfo::pageSize;
 
-    emit showFlags(rIt->combinedFlags[index]);
-    emit showPageInfo(addr, rIt->useCounts[index], QString::fromStdString(rIt->backingFile));
-}
-
-bool MosaicWidget::eventFilter(QObject *obj, QEvent *event)
-{
-    if (event->type() == QEvent::MouseButtonPress || event->type() == QEvent::MouseMove) {
-        QMouseEvent *me = static_cast<QMouseEvent *>(event);
-        if (me->buttons() & Qt::LeftButton) {
-            printPageFlagsAtPos(me->pos());
-            return true;
-        }
-    }
-    return QScrollArea::eventFilter(obj, event);
+    // pages that were not sampled have use count PageRun::unsampledUseCount and no flags
+    emit showFlags(rIt->pageFlags(index));
+    emit showPageInfo(addr, rIt->pageUseCount(index), QString::fromStdString(rIt->backingFile));
 }
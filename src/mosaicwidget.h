@@ -31,34 +31,117 @@
 
 #include <QByteArray>
 #include <QElapsedTimer>
+#include <QAbstractScrollArea>
+#include <QColor>
 #include <QImage>
-#include <QLabel>
-#include <QScrollArea>
-#include <QTimer>
+#include <QThread>
 #include <QTcpSocket>
 
+#include <atomic>
+#include <memory>
 #include <utility>
 #include <vector>
 #include "pageinfo.h"
+#include "workerpool.h"
 
 class PageInfoReader
 {
 public:
+    // what to send to the server right after connecting, see pageinfoprotocol.h
+    static QByteArray protocolHello();
     // returns true when a new dataset was just completed
     bool addData(const QByteArray &data);
     std::vector<MappedRegion> m_mappedRegions;
 
 private:
+    enum Protocol {
+        UnknownProtocol, // still waiting for the server's ProtocolHello or the first full snapshot
+        FullSnapshotsProtocol, // old server that didn't answer our ProtocolHello
+        FramesProtocol
+    };
+
+    // returns false if not enough data is buffered yet; *frameDone is set when a frame was processed
+    bool readCompressedBlock(bool *frameDone);
+    void processFrame(uint32_t frameType, const char *buf, size_t length);
+    // these return false if the data is invalid
+    bool readFullSnapshot(const char *buf, size_t length);
+    bool applyDelta(const char *buf, size_t length);
+
+    Protocol m_protocol = UnknownProtocol;
+    bool m_isCompressed = false;
+    bool m_hasRuns = false; // regions are in the format with runs
+    // only kept to reuse the memory of its runs and values when patching regions
+    MappedRegion m_patchScratch;
+    uint32_t m_frameType = 0;
     int64_t m_length = -1;
     QByteArray m_buffer;
+    // only with compression: decompressed data of the current frame, and state of reading it
+    std::vector<char> m_frame;
+    bool m_inCompressedFrame = false;
+    bool m_isFrameValid = true;
 };
 
-class MosaicWidget : public QScrollArea
+// Takes snapshots of a local process in a thread of its own (moveToThread() it), so that slow snapshots
+// of large processes don't block the GUI. The GUI thread always gets the latest snapshot; snapshots that
+// come in faster than the GUI picks them up are dropped.
+class SnapshotCollector : public QObject
 {
     Q_OBJECT
 public:
-    MosaicWidget(uint pid);
+    SnapshotCollector(uint pid, const PageInfo::Options &options);
+
+    // Returns the latest snapshot if there is one that was not returned before, else null. It is valid
+    // until the next call. Only call from one thread.
+    std::vector<MappedRegion> *takeSnapshot();
+
+signals:
+    // emitted from the collector thread when there is a new snapshot and no older one is waiting
+    void snapshotReady();
+
+public slots:
+    // takes snapshots, for as long as the thread runs
+    void collect();
+
+private:
+    // we're not usually *reaching* 50 milliseconds update interval... but trying doesn't hurt.
+    static const int s_updateInterval = 50;
+
+    PageCollector m_pageCollector;
+    // Triple buffering without locks: the collector thread writes to m_buffers[m_writeIndex], the GUI
+    // thread reads m_buffers[m_readIndex], and they swap their buffer with the one in m_latest, which
+    // also has freshFlag set while it has a snapshot that the GUI thread did not see yet.
+    static const unsigned int freshFlag = 4;
+    std::vector<MappedRegion> m_buffers[3];
+    unsigned int m_writeIndex;
+    unsigned int m_readIndex;
+    std::atomic<unsigned int> m_latest;
+};
+
+// Shows the pages of the address space as tiles, s_columnCount (see .cpp) per row. Only the rows that are
+// visible, plus some margin, are rendered, so the cost of an update depends on the size of the viewport,
+// not the size of the address space.
+class MosaicWidget : public QAbstractScrollArea
+{
+    Q_OBJECT
+public:
+    MosaicWidget(uint pid, const PageInfo::Options &options);
     MosaicWidget(const QByteArray &host, uint port);
+    ~MosaicWidget();
+
+    enum ColorScheme {
+        DefaultColors,
+        // for viewers with color vision deficiencies
+        ColorBlindColors
+    };
+    void setColorScheme(ColorScheme scheme);
+
+    // the zoom level: tiles are squares of 1, 2, 4 (the default) or 8 pixels
+    uint pixelsPerTile() const { return m_pixelsPerTile; }
+    void setPixelsPerTile(uint pixelsPerTile);
+
+public slots:
+    void zoomIn();
+    void zoomOut();
 
 signals:
     void showPageInfo(quint64 addr, quint32 useCount, const QString &backingFile);
@@ -67,34 +150,77 @@ signals:
     void serverConnectionBroke(bool);
 
 private slots:
+    void socketConnected();
     void socketError();
 
 protected:
-    bool eventFilter(QObject *, QEvent *) override;
+    QSize sizeHint() const override;
+    void paintEvent(QPaintEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
+    void scrollContentsBy(int dx, int dy) override;
+    // zooms with the control key pressed
+    void wheelEvent(QWheelEvent *event) override;
+    void mousePressEvent(QMouseEvent *event) override;
+    void mouseMoveEvent(QMouseEvent *event) override;
 
 private slots:
-    void localUpdateTimeout();
+    void localSnapshotReady();
     void networkDataAvailable();
 
 private:
-    void updatePageInfo(const std::vector<MappedRegion> &regions);
-
-    void printPageFlagsAtPos(const QPoint &widgetPos);
-    quint64 addressAtPos(const QPoint &widgetPos);
+    // shows m_regions
+    void updatePageInfo();
+    void updateScrollBars();
+    // sets classes to the TileClass (see .cpp) of each tile of rows [firstRow, endRow). Only reads
+    // members, so it can run on several threads for different rows.
+    void classifyRows(quint32 firstRow, quint32 endRow, uint8_t *classes) const;
+    // renders rows [firstRow, endRow) of the mosaic into m_img
+    void renderRows(quint32 firstRow, quint32 endRow);
+    // after an update with the same layout, repaints the tiles of m_img whose class changed
+    void repaintChangedTiles();
+
+    // pos is in viewport coordinates
+    void printPageFlagsAtPos(const QPoint &pos);
+    // pos is in mosaic coordinates
+    quint64 addressAtPos(const QPoint &pos);
     void printPageFlagsAtAddr(quint64 addr);
 
     uint m_pid;
-    QTimer m_updateTimer;
+    // only for a local process
+    std::unique_ptr<SnapshotCollector> m_snapshotCollector;
+    QThread m_collectorThread;
     QElapsedTimer m_updateIntervalWatch;
     QTcpSocket m_socket;
     PageInfoReader m_pageInfoReader;
 
     std::vector<MappedRegion> m_regions; // for tooltips and other mouseover info
-    // v meaning:  line, address (of the start of each largeRegion)
-    std::vector<std::pair<quint32, quint64>> m_largeRegions; // needed for picking the right info
 
-    QLabel m_mosaicWidget;
+    // A range of the address space without large gaps, shown in consecutive rows from firstRow on. Large
+    // regions are separated by a few rows of separator.
+    struct LargeRegion
+    {
+        quint32 firstRow;
+        quint64 start;
+        quint64 end;
+        bool operator==(const LargeRegion &other) const
+        {
+            return firstRow == other.firstRow && start == other.start && end == other.end;
+        }
+    };
+    std::vector<LargeRegion> m_largeRegions; // needed for picking the right info
+    quint32 m_rowCount;
+
+    // rows [m_imgFirstRow, m_imgEndRow) of the mosaic, if m_isImgValid, and the classes of their tiles
     QImage m_img;
+    std::vector<uint8_t> m_tileClasses;
+    std::vector<uint8_t> m_newTileClasses; // only kept to reuse its memory
+    quint32 m_imgFirstRow;
+    quint32 m_imgEndRow;
+    bool m_isImgValid;
+    const QRgb *m_tileColors; // indexed by TileClass
+    uint m_pixelsPerTile;
+    // one thread per core for classifying and painting bands of rows, see forEachBand() in the .cpp
+    WorkerPool m_bandPool;
 };
 
 #endif // MOSAICWIDGET_H
@@ -36,14 +36,122 @@
 // TODO
 // - tell the backing file for each MappedRegion in case there is one (mmap!)
 
+// A run of consecutive pages in a MappedRegion. It is either uniform, i.e. all its pages have the same
+// use count and flags (typically unpopulated address space), or dense, i.e. every page has its own
+// values, which are stored in MappedRegion::useCounts and combinedFlags.
+struct PageRun
+{
+    static const size_t uniformRun = size_t(-1);
+    // use count of the pages of uniform runs that were not read in a sampled snapshot
+    static const uint32_t unsampledUseCount = uint32_t(-1);
+    bool isUniform() const { return denseIndex == uniformRun; }
+
+    uint64_t firstPage; // index of the first page in the region
+    uint64_t pageCount;
+    // only used in uniform runs
+    uint32_t useCount;
+    uint32_t combinedFlags;
+    // index of the values of the first page in MappedRegion::useCounts and combinedFlags, or uniformRun
+    size_t denseIndex;
+};
+
+// In a sampled snapshot (see PageInfo::Options::sampleFraction), the pages of a large region are divided
+// into strata of about equal size, and only the pages of one cluster in each half of a stratum are read.
+// The clusters are at random places, and they move in each snapshot, so that consecutive snapshots look at different pages. The other
+// pages of the stratum are in uniform runs with PageRun::unsampledUseCount.
+struct SampleStratum
+{
+    uint64_t firstPage;
+    uint64_t endPage;
+    // [clusterFirst[i], clusterEnd[i]) is in the first (i = 0) or the second half of the stratum
+    uint64_t clusterFirst[2];
+    uint64_t clusterEnd[2];
+    // the number of places in its half that cluster i was picked from, all equally likely. The last one
+    // can be shorter than the others.
+    uint64_t clusterPositions[2];
+};
+
 struct MappedRegion
 {
+    // the "perms" column of /proc/<pid>/maps
+    enum Permission {
+        Readable = 1,
+        Writable = 2,
+        Executable = 4,
+        Shared = 8 // 's' instead of 'p' (private)
+    };
+
+    MappedRegion()
+       : start(0),
+         end(0),
+         permissions(0),
+         offset(0),
+         deviceMajor(0),
+         deviceMinor(0),
+         inode(0)
+    {}
+
     uint64_t start;
     uint64_t end;
+    // The following come from /proc/<pid>/maps. They are not sent to clients, so clients only have
+    // backingFile.
+    uint32_t permissions; // Permission flags
+    uint64_t offset; // in the backing file
+    uint32_t deviceMajor;
+    uint32_t deviceMinor;
+    uint64_t inode;
     std::string backingFile;
+    // Cover all pages of the region, sorted by firstPage. Memory usage is proportional to the number of
+    // populated pages, not to the size of the region, which can be gigantic for e.g. JVM heaps.
+    std::vector<PageRun> runs;
+    // values of the pages in dense runs
     std::vector<uint32_t> useCounts;
     std::vector<uint32_t> combinedFlags;
+    // Only in sampled snapshots, for regions that were not read completely: cover all pages of the
+    // region, sorted by firstPage. Not sent to clients.
+    std::vector<SampleStratum> sampleStrata;
+
     bool operator<(const MappedRegion &other) const { return start < other.start; }
+
+    uint64_t pageCount() const;
+    // index in runs of the run containing page, which must be < pageCount()
+    size_t findRun(uint64_t page) const;
+    uint32_t pageUseCount(uint64_t page) const;
+    uint32_t pageFlags(uint64_t page) const;
+    // makes the region consist of one dense run; useCounts and combinedFlags must contain the values
+    // of all pages
+    void setAllDense();
+};
+
+// Use count and flags of pages [firstPage, firstPage + pageCount) of a MappedRegion
+struct PageSpan
+{
+    uint64_t firstPage;
+    uint64_t pageCount;
+    uint32_t useCount;
+    uint32_t combinedFlags;
+};
+
+// Iterates over the pages of a MappedRegion in ascending order, without expanding uniform runs: each
+// uniform run is one span, each page of a dense run is one span with pageCount 1.
+// Usage: for (PageSpanIterator it(region); !it.atEnd(); ++it) { it->... }
+class PageSpanIterator
+{
+public:
+    // starts at firstPage; the first span is cut to start there if it is part of a uniform run
+    explicit PageSpanIterator(const MappedRegion &region, uint64_t firstPage = 0);
+
+    bool atEnd() const { return m_run >= m_region.runs.size(); }
+    const PageSpan &operator*() const { return m_span; }
+    const PageSpan *operator->() const { return &m_span; }
+    PageSpanIterator &operator++();
+
+private:
+    void updateSpan(uint64_t page);
+
+    const MappedRegion &m_region;
+    size_t m_run;
+    PageSpan m_span;
 };
 
 class PageInfo
@@ -52,10 +160,130 @@ public:
     static const unsigned int pageShift = 12;
     static const unsigned int pageSize = 1 << pageShift; // the well-known 4096 bytes
 
-    PageInfo(unsigned int pid);
+    enum Mode {
+        FullMode,
+        // Clear the soft-dirty bits of the process (via /proc/<pid>/clear_refs) after each snapshot, and
+        // only look up use count and flags for pages that were written to or remapped since the previous
+        // snapshot. Use counts and flags of pages that were merely shared or unshared by other processes
+        // in the meantime are not updated, and clearing the bits causes extra page faults in the process.
+        IncrementalMode
+    };
+
+    // what to collect per page
+    enum Level {
+        // use counts, and the flags from /proc/<pid>/pagemap
+        CountsLevel,
+        // also the flags from /proc/kpageflags
+        FullLevel
+    };
+
+    // PFNs that are at most that far apart are read from /proc/kpagecount and /proc/kpageflags in one
+    // go, including the PFNs in between. It has been determined empirically on one machine.
+    static const uint64_t defaultMaxPfnGap = 16;
+
+    struct Options
+    {
+        Options()
+           : mode(FullMode),
+             level(FullLevel),
+             threadCount(1),
+             maxPfnGap(defaultMaxPfnGap),
+             sampleFraction(1.0)
+        {}
+        Mode mode;
+        Level level;
+        // Threads used for reading /proc/kpagecount and /proc/kpageflags and for putting together the
+        // data, including the calling thread.
+        unsigned int threadCount;
+        // see defaultMaxPfnGap and calibrateMaxPfnGap()
+        uint64_t maxPfnGap;
+        // In (0, 1]: roughly which fraction of the pages of large regions to read, see SampleStratum.
+        // 1 reads all pages. Not supported by PageStreamer.
+        double sampleFraction;
+    };
+
+    // Takes a single snapshot. IncrementalMode only makes sense with PageCollector; here it is the same as
+    // FullMode.
+    explicit PageInfo(unsigned int pid, const Options &options = Options());
+
+    // Measures how long reading PFN information takes on this kernel and hardware, and returns the
+    // best maxPfnGap for that, or 0 if it could not be measured (usually because the user is not root).
+    // Takes some tens of milliseconds. perReadNs and perPfnNs, if not null, receive the fixed cost of
+    // reading a range of PFNs and the additional cost of each PFN in it.
+    static uint64_t calibrateMaxPfnGap(double *perReadNs = nullptr, double *perPfnNs = nullptr);
     const std::vector<MappedRegion> &mappedRegions() const { return m_mappedRegions; }
 private:
+    friend class PageCollectorPrivate;
+    PageInfo()
+       : m_softDirtyCleared(false)
+    {}
+
     std::vector<MappedRegion> m_mappedRegions;
+    // Needed in IncrementalMode to find out what changed in the next snapshot; a PageCollector also
+    // keeps them to reuse their memory. Index-aligned with m_mappedRegions if not empty.
+    std::vector<std::vector<uint64_t>> m_pagemapEntries;
+    bool m_softDirtyCleared;
+};
+
+class PageCollectorPrivate;
+
+// Takes snapshots of one process repeatedly, e.g. to watch it, and as needed for IncrementalMode. If the
+// kernel does not track soft-dirty bits, it warns and uses FullMode instead of IncrementalMode.
+// It keeps the files it reads open and reuses memory from the last-but-one snapshot and for temporary
+// data, so once the memory layout of the process is stable, taking a snapshot allocates little or no
+// memory.
+class PageCollector
+{
+public:
+    explicit PageCollector(unsigned int pid, const PageInfo::Options &options = PageInfo::Options());
+    ~PageCollector();
+
+    // The returned snapshot is valid until the next-but-one call of collect(); after the next call,
+    // previous() returns it.
+    const PageInfo &collect();
+    // the snapshot before the last one, or null
+    const PageInfo *previous() const;
+
+private:
+    PageCollector(const PageCollector &) = delete;
+    PageCollector &operator=(const PageCollector &) = delete;
+
+    PageCollectorPrivate *d;
+};
+
+// Takes snapshots of one process in parts with a limited number of pages each, so that the memory needed
+// for page information does not grow with the size of the process; only the list of regions is kept
+// completely. For sending snapshots while they are taken, on systems where memory is scarce. The parts
+// are collected at different times, so a snapshot is less consistent than one from a PageCollector.
+// IncrementalMode is not supported.
+class PageStreamer
+{
+public:
+    // memoryLimit is about the maximum number of bytes used for the page information of a part
+    PageStreamer(unsigned int pid, size_t memoryLimit, const PageInfo::Options &options = PageInfo::Options());
+    ~PageStreamer();
+
+    // Starts a new snapshot by reading the list of regions, whose page information is left empty
+    void start();
+    const std::vector<MappedRegion> &regions() const;
+    // Returns the page information of a part of regions()[region] that contains page, as a region that
+    // starts at page *firstPage of regions()[region]. If page is not in the current part, it collects the
+    // part that contains it, which invalidates the previously returned region. Going through the pages
+    // in order, every part is collected once; going back to a previous part collects it again.
+    const MappedRegion &regionPages(size_t region, uint64_t page, uint64_t *firstPage);
+
+private:
+    PageStreamer(const PageStreamer &) = delete;
+    PageStreamer &operator=(const PageStreamer &) = delete;
+
+    // Roughly what collecting a page costs in memory: its pagemap entry, use count, flags, PFN in two
+    // lists and the sort scratch space, plus the PFN buffer which also contains some unused PFNs.
+    static const size_t bytesPerPage = 80;
+    // below that, the overhead per part gets too large
+    static const uint64_t minPartPages = 1024;
+
+    PageCollectorPrivate *d;
+    const uint64_t m_maxPartPages;
 };
 
 #endif // PAGEINFO_H
@@ -0,0 +1,92 @@
+/*
+  pageinfoprotocol.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEINFOPROTOCOL_H
+#define PAGEINFOPROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Protocol between memstat in server mode and qmemstat in client mode.
+//
+// Originally, the server just sent one full snapshot after the other (the format is described in
+// pageinfoserializer.cpp) and never read anything from the client. To stay compatible with such clients,
+// that is still what happens unless the client sends a ProtocolHello right after connecting. In that case,
+// the server answers with a ProtocolHello containing the subset of requested features that it supports,
+// and then sends frames, each consisting of a uint32_t FrameType followed by the frame data.
+// Old servers never answer, which the client notices because the first 8 bytes it receives are not
+// protocolMagic, but the length of a full snapshot.
+// With CompressionFeature, the frame data after the FrameType is compressed as described in compression.h.
+// With RunsFeature, regions are sent with their runs of pages instead of the values of every page, see
+// pageinfoserializer.cpp.
+
+static const uint64_t protocolMagic = 0x544154534d454d51; // "QMEMSTAT" in little endian
+
+struct ProtocolHello
+{
+    uint64_t magic;
+    uint32_t features; // ProtocolFeature flags
+    uint32_t reserved;
+};
+
+enum ProtocolFeature : uint32_t
+{
+    // the server may send DeltaFrames
+    DeltaFeature = 1,
+    // frame data is compressed
+    CompressionFeature = 2,
+    // regions in KeyFrames and NewRegionOps are in the format with runs
+    RunsFeature = 4
+};
+
+// size of a PageRun in the format with runs
+static const size_t serializedRunSize = 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+enum FrameType : uint32_t
+{
+    // full snapshot, in the same format as without ProtocolHello, or with runs with RunsFeature
+    KeyFrame = 0,
+    // only the differences to the previous snapshot, see PageInfoDeltaSerializer
+    DeltaFrame = 1
+};
+
+// Operations in a DeltaFrame. Each one appends one or more regions to the new snapshot.
+enum DeltaOp : uint32_t
+{
+    // uint32_t index of first region in previous snapshot, uint32_t count:
+    // copy count consecutive regions of the previous snapshot
+    CopyRegionsOp = 0,
+    // uint32_t index of region in previous snapshot, uint32_t patch count, then patch count times:
+    // uint64_t first page, uint64_t page count (regions can have 2^32 pages or more), uint32_t
+    // useCounts[page count], uint32_t combinedFlags[page count]
+    PatchRegionOp = 1,
+    // a whole region in the same format as in a full snapshot; patches apply to regions in either format
+    NewRegionOp = 2
+};
+
+#endif // PAGEINFOPROTOCOL_H
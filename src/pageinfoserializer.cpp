@@ -13,6 +13,32 @@
     until read position == length + sizeof(length)
     ... at exactly which point the last MappedRegion must also end, obviously
 
+ serialized format with RunsFeature (see pageinfoprotocol.h):
+    uint64_t length
+    repeat
+        uint64_t MappedRegion::start
+        uint64_t MappedRegion::end
+        uint32_t backingFile.length()
+        char[backingFile.length()]
+        padding to next uint32_t (4 byte boundary)
+        uint32_t runs.size()
+        uint32_t useCounts.size(), the number of pages in dense runs
+        repeat runs.size() times, in ascending order of pages, covering all pages of the region
+            uint64_t PageRun::pageCount
+            uint64_t PageRun::denseIndex, all bits set for a uniform run
+            uint32_t PageRun::useCount, 0 in a dense run
+            uint32_t PageRun::combinedFlags, 0 in a dense run
+        uint32_t useCounts[useCounts.size()]
+        uint32_t combinedFlags[useCounts.size()]
+    until read position == length + sizeof(length)
+
+ delta format (see also pageinfoprotocol.h):
+    uint64_t length (in bytes, length field not included in length)
+    repeat
+        uint32_t DeltaOp
+        operands of the DeltaOp
+    until read position == length + sizeof(length)
+
   there is no endianness flag - little endian is used because it's the only endianness of x86 and
   the default endianness on ARM
  */
@@ -22,6 +48,16 @@ class PageInfoSerializer
 public:
     PageInfoSerializer(const PageInfo &pageInfo)
        : m_mappedRegions(pageInfo.mappedRegions()),
+         m_streamer(nullptr),
+         m_region(-1),
+         m_posInRegion(0)
+    {}
+    // Serializes the snapshot that streamer has been start()ed for, while collecting it part by part.
+    // Regions that are split into several parts are collected twice, once for the use counts and once
+    // for the flags.
+    explicit PageInfoSerializer(PageStreamer *streamer)
+       : m_mappedRegions(streamer->regions()),
+         m_streamer(streamer),
          m_region(-1),
          m_posInRegion(0)
     {}
@@ -35,6 +71,7 @@ private:
     static size_t chunkSize() { return sizeof(m_buffer); }
 
     const std::vector<MappedRegion> &m_mappedRegions;
+    PageStreamer *m_streamer; // if not null, m_mappedRegions have no page information
     int m_region;
     size_t m_posInRegion;
     char m_buffer[16 * 1024]; // must be >= padded size of longest string we're going to have
@@ -107,20 +144,63 @@ bool PageInfoSerializer::nextRegionIf(bool cond)
     return cond;
 }
 
+// Writes the use counts (or flags if isFlags) of pages [firstPage, firstPage + count) of mr to out.
+// The format without runs has the values of every page, so runs are expanded here.
+static void expandPageValues(const MappedRegion &mr, bool isFlags, uint64_t firstPage, size_t count,
+                             uint32_t *out)
+{
+    uint64_t page = firstPage;
+    for (size_t r = count ? mr.findRun(firstPage) : 0; count; r++) {
+        const PageRun &run = mr.runs[r];
+        const size_t amount = min(size_t(run.firstPage + run.pageCount - page), count);
+        if (run.isUniform()) {
+            fill_n(out, amount, isFlags ? run.combinedFlags : run.useCount);
+        } else {
+            const uint32_t *const values = (isFlags ? mr.combinedFlags : mr.useCounts).data() +
+                                           run.denseIndex + (page - run.firstPage);
+            copy(values, values + amount, out);
+        }
+        out += amount;
+        page += amount;
+        count -= amount;
+    }
+}
+
+// size of a region in the format with runs
+static uint64_t serializedSizeWithRuns(const MappedRegion &mr)
+{
+    return 2 * sizeof(uint64_t) + padStringStorageSize(stringStorageSize(mr.backingFile)) +
+           2 * sizeof(uint32_t) + mr.runs.size() * serializedRunSize + mr.useCounts.size() * 2 * sizeof(uint32_t);
+}
+
+// size of a full snapshot, excluding the length field
+static uint64_t serializedSize(const std::vector<MappedRegion> &mappedRegions, bool withRuns = false)
+{
+    if (withRuns) {
+        uint64_t size = 0;
+        for (const MappedRegion &mr : mappedRegions) {
+            size += serializedSizeWithRuns(mr);
+        }
+        return size;
+    }
+
+    uint64_t size = mappedRegions.size() * 2 * sizeof(uint64_t); // all the "start" and "end" members
+
+    for (const MappedRegion &mr : mappedRegions) {
+        // useCounts and combinedFlags
+        size += (mr.end - mr.start) / PageInfo::pageSize * 2 * sizeof(uint32_t);
+        // backingFile strings
+        size += padStringStorageSize(stringStorageSize(mr.backingFile));
+    }
+    return size;
+}
+
 pair<const char*, size_t> PageInfoSerializer::serializeMore()
 {
     size_t bufPos = 0;
     if (m_region == -1) {
         // write the size of the whole list of MappedRegions into the output as a framing header
-        uint64_t size = m_mappedRegions.size() * 2 * sizeof(uint64_t); // all the "start" and "end" members
-
-        for (const MappedRegion &mr : m_mappedRegions) {
-            // useCounts and combinedFlags
-            size += (mr.end - mr.start) / PageInfo::pageSize * 2 * sizeof(uint32_t);
-            // backingFile strings
-            size += padStringStorageSize(stringStorageSize(mr.backingFile));
-        }
-        placePrimitiveTypeAt(size, &bufPos);
+        placePrimitiveTypeAt(serializedSize(m_mappedRegions), &bufPos);
         nextRegionIf(true);
     }
 
@@ -142,7 +222,7 @@ pair<const char*, size_t> PageInfoSerializer::serializeMore()
         wrote = placeStringAt(mr.backingFile, &bufPos, &regionMemberOffset) || wrote;
 
         if (m_posInRegion >= regionMemberOffset) {
-            const size_t arraySize = (mr.end - mr.start) / PageInfo::pageSize * sizeof(uint32_t);
+            const size_t arraySize = mr.pageCount() * sizeof(uint32_t);
             if (nextRegionIf(!arraySize)) {
                 wrote = true;
                 continue;
@@ -154,22 +234,35 @@ pair<const char*, size_t> PageInfoSerializer::serializeMore()
             }
             const size_t arrayEnd = regionMemberOffset + arraySize;
             assert(m_posInRegion < arrayEnd);
+            // everything before is a multiple of sizeof(uint32_t) in size, and so is chunkSize()
+            assert((m_posInRegion - regionMemberOffset) % sizeof(uint32_t) == 0);
+            const uint64_t regionPage = (m_posInRegion - regionMemberOffset) / sizeof(uint32_t);
+            // the pages of a streamed region may be split into several parts
+            uint64_t pagesStart = 0;
+            const MappedRegion &pages = m_streamer ? m_streamer->regionPages(m_region, regionPage, &pagesStart)
+                                                   : mr;
+            const uint64_t page = regionPage - pagesStart;
+            const size_t pagesEnd = regionMemberOffset + (pagesStart + pages.pageCount()) * sizeof(uint32_t);
 
-            const char *const data = reinterpret_cast<const char*>(isFlags ? &mr.combinedFlags[0]
-                                                                           : &mr.useCounts[0])
-                                         + m_posInRegion - regionMemberOffset;
-
-            if (bufPos == 0 && m_posInRegion + chunkSize() <= arrayEnd) {
-                // zero-copy fast path!
-                m_posInRegion += chunkSize();
-                nextRegionIf(isFlags && m_posInRegion >= arrayEnd);
-                // it may or may not be a a good idea to send more than the usual chunkSize() in this case;
-                // it may not be a good idea because large write()s might use more buffer memory somewhere
-                return make_pair(data, chunkSize());
+            if (bufPos == 0 && m_posInRegion + chunkSize() <= pagesEnd) {
+                const PageRun &run = pages.runs[pages.findRun(page)];
+                if (!run.isUniform() && page + chunkSize() / sizeof(uint32_t) <= run.firstPage + run.pageCount) {
+                    // zero-copy fast path!
+                    const char *const data = reinterpret_cast<const char*>(
+                        (isFlags ? pages.combinedFlags : pages.useCounts).data() + run.denseIndex +
+                        (page - run.firstPage));
+                    m_posInRegion += chunkSize();
+                    nextRegionIf(isFlags && m_posInRegion >= arrayEnd);
+                    // it may or may not be a a good idea to send more than the usual chunkSize() in this
+                    // case; it may not be a good idea because large write()s might use more buffer memory
+                    // somewhere
+                    return make_pair(data, chunkSize());
+                }
             }
 
-            size_t amount = min(chunkSize() - bufPos, arrayEnd - m_posInRegion);
-            memcpy(m_buffer + bufPos, data, amount);
+            size_t amount = min(chunkSize() - bufPos, pagesEnd - m_posInRegion);
+            expandPageValues(pages, isFlags, page, amount / sizeof(uint32_t),
+                             reinterpret_cast<uint32_t *>(m_buffer + bufPos));
             m_posInRegion += amount;
             bufPos += amount;
             wrote = true;
@@ -184,3 +277,351 @@ pair<const char*, size_t> PageInfoSerializer::serializeMore()
 
     return make_pair(m_buffer, bufPos);
 }
+
+template<typename T>
+static void appendPrimitive(std::vector<char> *data, T value)
+{
+    const size_t pos = data->size();
+    data->resize(pos + sizeof(value));
+    memcpy(&(*data)[pos], &value, sizeof(value));
+}
+
+// Appends start, end and backing file of mr, which a region starts with in both formats
+static void appendRegionHeader(std::vector<char> *data, const MappedRegion &mr)
+{
+    appendPrimitive(data, mr.start);
+    appendPrimitive(data, mr.end);
+    const size_t strSize = stringStorageSize(mr.backingFile);
+    appendPrimitive(data, uint32_t(mr.backingFile.length()));
+    data->insert(data->end(), mr.backingFile.begin(), mr.backingFile.end());
+    data->resize(data->size() + padStringStorageSize(strSize) - strSize, 0);
+}
+
+// Appends what follows the header of mr in the format with runs, up to the dense values
+static void appendRuns(std::vector<char> *data, const MappedRegion &mr)
+{
+    assert(mr.useCounts.size() == mr.combinedFlags.size());
+    data->reserve(data->size() + 2 * sizeof(uint32_t) + mr.runs.size() * serializedRunSize);
+    appendPrimitive(data, uint32_t(mr.runs.size()));
+    appendPrimitive(data, uint32_t(mr.useCounts.size()));
+    for (const PageRun &run : mr.runs) {
+        const bool isUniform = run.isUniform();
+        appendPrimitive(data, run.pageCount);
+        appendPrimitive(data, isUniform ? ~uint64_t(0) : uint64_t(run.denseIndex));
+        appendPrimitive(data, isUniform ? run.useCount : 0u);
+        appendPrimitive(data, isUniform ? run.combinedFlags : 0u);
+    }
+}
+
+// Serializes a snapshot in the format with runs. Like PageInfoSerializer, it works incrementally and
+// does not keep the encoded snapshot in memory: only the header and runs of the current region are
+// encoded, and the dense values are copied from the snapshot, or sent from it directly.
+class PageInfoRunsSerializer
+{
+public:
+    explicit PageInfoRunsSerializer(const PageInfo &pageInfo);
+    pair<const char*, size_t> serializeMore();
+
+private:
+    // what is sent of each region, in this order
+    enum Part {
+        RunsPart, // m_runs
+        UseCountsPart,
+        FlagsPart,
+        PartCount
+    };
+    pair<const char*, size_t> partData() const;
+    void encodeRuns();
+    static size_t chunkSize() { return sizeof(m_buffer); }
+
+    const std::vector<MappedRegion> &m_mappedRegions;
+    size_t m_region;
+    int m_part;
+    size_t m_posInPart;
+    // header and runs of the current region, preceded by the length field for the first one
+    std::vector<char> m_runs;
+    char m_buffer[16 * 1024];
+};
+
+PageInfoRunsSerializer::PageInfoRunsSerializer(const PageInfo &pageInfo)
+   : m_mappedRegions(pageInfo.mappedRegions()),
+     m_region(0),
+     m_part(RunsPart),
+     m_posInPart(0)
+{
+    appendPrimitive(&m_runs, serializedSize(m_mappedRegions, true));
+    encodeRuns();
+}
+
+void PageInfoRunsSerializer::encodeRuns()
+{
+    if (m_region < m_mappedRegions.size()) {
+        appendRegionHeader(&m_runs, m_mappedRegions[m_region]);
+        appendRuns(&m_runs, m_mappedRegions[m_region]);
+    }
+}
+
+pair<const char*, size_t> PageInfoRunsSerializer::partData() const
+{
+    if (m_part == RunsPart) {
+        return make_pair(m_runs.data(), m_runs.size());
+    }
+    const MappedRegion &mr = m_mappedRegions[m_region];
+    const std::vector<uint32_t> &values = m_part == UseCountsPart ? mr.useCounts : mr.combinedFlags;
+    return make_pair(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(uint32_t));
+}
+
+pair<const char*, size_t> PageInfoRunsSerializer::serializeMore()
+{
+    size_t bufPos = 0;
+    // without regions, there is still the length field in m_runs
+    while (bufPos < chunkSize() &&
+           (m_region < m_mappedRegions.size() || (m_part == RunsPart && m_posInPart < m_runs.size()))) {
+        const pair<const char*, size_t> data = partData();
+        if (m_posInPart == data.second) {
+            m_posInPart = 0;
+            if (++m_part == PartCount) {
+                m_part = RunsPart;
+                m_region++;
+                m_runs.clear();
+                encodeRuns();
+            }
+            continue;
+        }
+        if (bufPos == 0 && m_part != RunsPart && data.second - m_posInPart >= chunkSize()) {
+            // zero-copy fast path, as in PageInfoSerializer
+            const char *const chunk = data.first + m_posInPart;
+            m_posInPart += chunkSize();
+            return make_pair(chunk, chunkSize());
+        }
+        const size_t amount = min(chunkSize() - bufPos, data.second - m_posInPart);
+        memcpy(m_buffer + bufPos, data.first + m_posInPart, amount);
+        bufPos += amount;
+        m_posInPart += amount;
+    }
+    return make_pair(m_buffer, bufPos);
+}
+
+// Encodes the differences between two snapshots in the delta format, with new regions in the format with
+// runs if withRuns. Unlike PageInfoSerializer, it does not work incrementally, so it keeps the whole
+// encoded data in memory. That is usually not much, and it gives up when it would exceed maxSize.
+class PageInfoDeltaSerializer
+{
+public:
+    PageInfoDeltaSerializer(const PageInfo &previous, const PageInfo &current, bool withRuns, size_t maxSize);
+    // false if encoding would have taken more than maxSize bytes; send a full snapshot in that case.
+    bool isValid() const { return m_isValid; }
+    pair<const char*, size_t> serializeMore();
+
+private:
+    template<typename T>
+    void append(T value);
+    void appendPageValues(const MappedRegion &mr, bool isFlags, uint64_t firstPage, size_t count);
+    void appendRegion(const MappedRegion &mr);
+    // appends the changes from previous to current, which have the same size, as patches or as a new
+    // region, whichever is smaller. Returns false if the patches would not fit into maxSize.
+    bool appendPatches(uint32_t previousIndex, const MappedRegion &previous, const MappedRegion &current,
+                       size_t maxSize);
+
+    const bool m_withRuns;
+    std::vector<char> m_data;
+    size_t m_sentPos;
+    bool m_isValid;
+};
+
+template<typename T>
+void PageInfoDeltaSerializer::append(T value)
+{
+    appendPrimitive(&m_data, value);
+}
+
+void PageInfoDeltaSerializer::appendPageValues(const MappedRegion &mr, bool isFlags, uint64_t firstPage,
+                                               size_t count)
+{
+    const size_t pos = m_data.size();
+    m_data.resize(pos + count * sizeof(uint32_t));
+    expandPageValues(mr, isFlags, firstPage, count, reinterpret_cast<uint32_t *>(&m_data[pos]));
+}
+
+void PageInfoDeltaSerializer::appendRegion(const MappedRegion &mr)
+{
+    appendRegionHeader(&m_data, mr);
+    if (m_withRuns) {
+        appendRuns(&m_data, mr);
+        for (const std::vector<uint32_t> *values : { &mr.useCounts, &mr.combinedFlags }) {
+            const char *const data = reinterpret_cast<const char *>(values->data());
+            m_data.insert(m_data.end(), data, data + values->size() * sizeof(uint32_t));
+        }
+    } else {
+        appendPageValues(mr, false, 0, mr.pageCount());
+        appendPageValues(mr, true, 0, mr.pageCount());
+    }
+}
+
+// Calls f(firstPage, pageCount) for each patch that turns the pages of previous into those of current,
+// which have the same size, in ascending order
+template<typename F>
+static void forEachPatch(const MappedRegion &previous, const MappedRegion &current, F f)
+{
+    // a patch header costs as much as two pages, so it's about break-even to include two unchanged pages
+    static const uint64_t maxUnchangedInPatch = 2;
+
+    bool inPatch = false;
+    uint64_t first = 0;
+    uint64_t last = 0;
+
+    // Walk both regions in parallel, in parts where the spans of both don't change. That way, long uniform
+    // runs are compared in one step.
+    PageSpanIterator prevSpan(previous);
+    PageSpanIterator curSpan(current);
+    uint64_t page = 0;
+    while (!curSpan.atEnd()) {
+        assert(!prevSpan.atEnd());
+        const uint64_t prevEnd = prevSpan->firstPage + prevSpan->pageCount;
+        const uint64_t curEnd = curSpan->firstPage + curSpan->pageCount;
+        const uint64_t end = min(prevEnd, curEnd);
+        if (prevSpan->useCount != curSpan->useCount || prevSpan->combinedFlags != curSpan->combinedFlags) {
+            if (inPatch && page > last + maxUnchangedInPatch + 1) {
+                f(first, last + 1 - first);
+                inPatch = false;
+            }
+            if (!inPatch) {
+                inPatch = true;
+                first = page;
+            }
+            last = end - 1;
+        }
+        page = end;
+        if (prevEnd == end) {
+            ++prevSpan;
+        }
+        if (curEnd == end) {
+            ++curSpan;
+        }
+    }
+    if (inPatch) {
+        f(first, last + 1 - first);
+    }
+}
+
+bool PageInfoDeltaSerializer::appendPatches(uint32_t previousIndex, const MappedRegion &previous,
+                                            const MappedRegion &current, size_t maxSize)
+{
+    // Find out the size first: the values of a patch are expanded, which can take a lot of memory when
+    // large parts of a large region changed. Patches contain every page that changed, while runs can
+    // describe many pages in one, so a NewRegionOp is the better choice then.
+    uint64_t patchesSize = sizeof(PatchRegionOp) + sizeof(previousIndex) + sizeof(uint32_t);
+    uint64_t patchCount = 0;
+    forEachPatch(previous, current, [&patchesSize, &patchCount](uint64_t, uint64_t pageCount) {
+        patchesSize += 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t) * pageCount;
+        patchCount++;
+    });
+    if (m_withRuns && patchesSize > sizeof(NewRegionOp) + serializedSizeWithRuns(current)) {
+        append(NewRegionOp);
+        appendRegion(current);
+        return true;
+    }
+    if (patchCount > UINT32_MAX || m_data.size() + patchesSize > maxSize) {
+        return false;
+    }
+
+    append(PatchRegionOp);
+    append(previousIndex);
+    append(uint32_t(patchCount));
+    forEachPatch(previous, current, [this, &current](uint64_t firstPage, uint64_t pageCount) {
+        append(firstPage);
+        append(pageCount);
+        appendPageValues(current, false, firstPage, pageCount);
+        appendPageValues(current, true, firstPage, pageCount);
+    });
+    return true;
+}
+
+static bool isSameRun(const PageRun &a, const PageRun &b)
+{
+    return a.firstPage == b.firstPage && a.pageCount == b.pageCount && a.useCount == b.useCount &&
+           a.combinedFlags == b.combinedFlags && a.denseIndex == b.denseIndex;
+}
+
+// true if a and b are the same except possibly for their backing files
+static bool haveSamePages(const MappedRegion &a, const MappedRegion &b)
+{
+    return a.start == b.start && a.end == b.end &&
+           a.runs.size() == b.runs.size() && equal(a.runs.begin(), a.runs.end(), b.runs.begin(), isSameRun) &&
+           a.useCounts == b.useCounts && a.combinedFlags == b.combinedFlags;
+}
+
+PageInfoDeltaSerializer::PageInfoDeltaSerializer(const PageInfo &previous, const PageInfo &current,
+                                                 bool withRuns, size_t maxSize)
+   : m_withRuns(withRuns),
+     m_sentPos(0),
+     m_isValid(true)
+{
+    const std::vector<MappedRegion> &prevRegions = previous.mappedRegions();
+    const std::vector<MappedRegion> &curRegions = current.mappedRegions();
+
+    uint64_t length = 0;
+    append(length); // placeholder
+
+    // runs of unchanged regions are merged into one CopyRegionsOp
+    uint32_t copyStart = 0;
+    uint32_t copyCount = 0;
+    auto flushCopy = [this, &copyCount, &copyStart]() {
+        if (copyCount) {
+            append(CopyRegionsOp);
+            append(copyStart);
+            append(copyCount);
+            copyCount = 0;
+        }
+    };
+
+    // both lists are sorted by address, so find matching regions by walking them in parallel
+    size_t iPrev = 0;
+    for (const MappedRegion &mr : curRegions) {
+        while (iPrev < prevRegions.size() && prevRegions[iPrev].start < mr.start) {
+            iPrev++;
+        }
+        const MappedRegion *prev = iPrev < prevRegions.size() ? &prevRegions[iPrev] : nullptr;
+        if (prev && prev->start == mr.start && prev->end == mr.end && prev->backingFile == mr.backingFile) {
+            if (haveSamePages(*prev, mr)) {
+                if (copyCount && copyStart + copyCount != iPrev) {
+                    flushCopy();
+                }
+                if (!copyCount) {
+                    copyStart = iPrev;
+                }
+                copyCount++;
+            } else {
+                flushCopy();
+                if (!appendPatches(iPrev, *prev, mr, maxSize)) {
+                    m_isValid = false;
+                    m_data.clear();
+                    return;
+                }
+            }
+        } else {
+            flushCopy();
+            append(NewRegionOp);
+            appendRegion(mr);
+        }
+
+        if (m_data.size() > maxSize) {
+            m_isValid = false;
+            m_data.clear();
+            return;
+        }
+    }
+    flushCopy();
+
+    length = m_data.size() - sizeof(length);
+    memcpy(&m_data[0], &length, sizeof(length));
+}
+
+pair<const char*, size_t> PageInfoDeltaSerializer::serializeMore()
+{
+    static const size_t chunkSize = 16 * 1024; // same as PageInfoSerializer
+    const size_t amount = min(chunkSize, m_data.size() - m_sentPos);
+    const char *const data = m_data.data() + m_sentPos;
+    m_sentPos += amount;
+    return make_pair(data, amount);
+}
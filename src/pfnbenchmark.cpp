@@ -0,0 +1,134 @@
+/*
+  pfnbenchmark.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+// Compares rangifyPfns() with the std::sort() and std::unique() implementation that it replaced, on
+// random PFNs. Not built by default: make pfnbenchmark
+
+// for the static functions
+#include "pageinfo.cpp"
+
+#include <random>
+
+using namespace std;
+
+// the old implementation
+static void rangifyPfnsSortUnique(vector<uint64_t> *pfns, uint64_t maxGapSize, size_t *bufferPos,
+                                  vector<PfnRange> *ranges)
+{
+    ranges->clear();
+    if (pfns->empty()) {
+        return;
+    }
+    sort(pfns->begin(), pfns->end());
+    pfns->erase(unique(pfns->begin(), pfns->end()), pfns->end());
+
+    PfnRange range;
+    range.start = pfns->front();
+    range.last = pfns->front();
+    for (uint64_t pfn : *pfns) {
+        if (pfn > range.last + maxGapSize) {
+            range.allocBufferSpace(bufferPos);
+            ranges->push_back(range);
+            range.start = pfn;
+        }
+        range.last = pfn;
+    }
+    range.allocBufferSpace(bufferPos);
+    ranges->push_back(range);
+}
+
+static bool operator==(const PfnRange &a, const PfnRange &b)
+{
+    return a.start == b.start && a.last == b.last && a.m_bufferOffset == b.m_bufferOffset;
+}
+
+template<typename F>
+static uint64_t msecsFor(F f)
+{
+    const auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t maxGapSize = 16;
+    if (argc > 1) {
+        maxGapSize = strtoull(argv[1], nullptr, 10);
+    }
+    struct Case
+    {
+        uint64_t count;
+        uint64_t span; // the PFNs are in [base, base + span)
+    };
+    static const uint64_t M = 1024 * 1024;
+    static const Case cases[] = {
+        { 1 * M, 1 * M + M / 2 },
+        { 10 * M, 16 * M },
+        { 50 * M, 64 * M },
+        { 1 * M, 64 * M },
+        { 10 * M, 256 * M },
+        { 50 * M, 1024 * M },
+        { 10 * M, 4096 * M },
+        { 1000, 1 * M } // std::sort() in both
+    };
+
+    bool allEqual = true;
+    mt19937_64 random(42);
+    for (const Case &c : cases) {
+        // not starting at 0, like real PFNs
+        const uint64_t base = 0x100000;
+        uniform_int_distribution<uint64_t> distribution(base, base + c.span - 1);
+        vector<uint64_t> pfns(c.count);
+        for (uint64_t &pfn : pfns) {
+            pfn = distribution(random);
+        }
+
+        vector<uint64_t> oldPfns = pfns;
+        size_t oldBufferPos = 0;
+        vector<PfnRange> oldRanges;
+        const uint64_t oldMsecs = msecsFor([&] {
+            rangifyPfnsSortUnique(&oldPfns, maxGapSize, &oldBufferPos, &oldRanges);
+        });
+        oldPfns = vector<uint64_t>();
+
+        vector<uint64_t> scratch;
+        size_t newBufferPos = 0;
+        vector<PfnRange> newRanges;
+        const uint64_t newMsecs = msecsFor([&] {
+            rangifyPfns(&pfns, maxGapSize, &scratch, &newBufferPos, &newRanges);
+        });
+
+        const bool equal = oldBufferPos == newBufferPos && oldRanges == newRanges;
+        allEqual = allEqual && equal;
+        cout << "count " << c.count << " span " << c.span << ": " << oldMsecs << " ms -> " << newMsecs
+             << " ms, " << newRanges.size() << " ranges" << (equal ? "" : ", DIFFERENT RANGES") << '\n';
+    }
+    return allEqual ? 0 : 1;
+}
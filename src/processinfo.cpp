@@ -34,6 +34,7 @@
 // POSIX specific, but this whole program only works on Linux anyway!
 #include <sys/types.h>
 #include <dirent.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -77,3 +78,40 @@ vector<ProcessPid> readProcessList()
 
     return ret;
 }
+
+bool readMemoryRollup(unsigned int pid, MemoryRollup *rollup)
+{
+    const string procDir = "/proc/" + to_string(pid);
+
+    ifstream statmFile(procDir + "/statm");
+    uint64_t vszPages = 0;
+    if (!(statmFile >> vszPages)) {
+        return false;
+    }
+    rollup->vsz = vszPages * sysconf(_SC_PAGESIZE);
+
+    ifstream smapsFile(procDir + "/smaps_rollup");
+    if (!smapsFile.is_open()) {
+        // the per-mapping values of smaps just need to be added up
+        smapsFile.open(procDir + "/smaps");
+    }
+    rollup->rss = 0;
+    rollup->pss = 0;
+    // reading fails, not opening, if we may not look at the process
+    bool haveRss = false;
+    string line;
+    while (getline(smapsFile, line)) {
+        // e.g. "Rss:                4460 kB"; mind that other fields like "Pss_Anon:" start similarly
+        uint64_t *value = nullptr;
+        if (line.compare(0, 4, "Rss:") == 0) {
+            value = &rollup->rss;
+            haveRss = true;
+        } else if (line.compare(0, 4, "Pss:") == 0) {
+            value = &rollup->pss;
+        }
+        if (value) {
+            *value += strtoull(line.c_str() + line.find(':') + 1, nullptr, 10) * 1024;
+        }
+    }
+    return haveRss;
+}
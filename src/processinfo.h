@@ -43,4 +43,17 @@ struct ProcessPid
 // so the "natural" interface is a list on which one can do arbitrary matching.
 std::vector<ProcessPid> readProcessList();
 
+// Memory use totals of a process as accounted by the kernel, in bytes
+struct MemoryRollup
+{
+    uint64_t vsz;
+    uint64_t rss;
+    uint64_t pss;
+};
+
+// Reads the totals from /proc/<pid>/statm and /proc/<pid>/smaps_rollup (or /proc/<pid>/smaps on kernels
+// older than 4.14). That is much cheaper than going through all pages with PageInfo, and does not need
+// root for processes of the same user. Returns false if the files could not be read.
+bool readMemoryRollup(unsigned int pid, MemoryRollup *rollup);
+
 #endif // PROCESSINFO_H
@@ -28,8 +28,11 @@
 
 #include "processinfo.h"
 
+#include "commandline.h"
 #include "mainwindow.h"
+#include "mosaicwidget.h"
 
+#include <algorithm>
 #include <iostream>
 #include <linux/kernel-page-flags.h>
 #include "linux-pm-bits.h"
@@ -44,12 +47,35 @@ using namespace std;
 
 static void printUsage()
 {
-    cerr << "Usage: qmemstat <pid>/<process-name>\n"
-         << "       qmemstat --client <host> [<port>]\n";
+    cerr << "Usage: qmemstat <pid>/<process-name> [--incremental] [--threads <n>] [--io-uring]\n"
+         << "                [--max-pfn-gap <n> | --calibrate] [--sample <fraction>]\n"
+         << "       qmemstat --client <host> [<port>]\n"
+         << "Options:\n"
+         << "  --color-blind  use colors that are distinguishable with common color vision deficiencies\n"
+         << "  --incremental  only update pages written to since the previous snapshot. This clears the\n"
+         << "                 soft-dirty bits of the process, so it interferes with other users of them.\n"
+         << "  --threads <n>  use n threads to read and combine page information (default: 1)\n"
+         << "  --io-uring     read page information in batches using io_uring, if available\n"
+         << "  --max-pfn-gap <n>  read PFN information for PFNs up to n apart in one go (default: "
+         << PageInfo::defaultMaxPfnGap << ")\n"
+         << "  --calibrate    measure the best value for --max-pfn-gap on this system and use it\n"
+         << "  --sample <fraction>  read only about that fraction (e.g. 0.01) of the pages of large\n"
+         << "                 mappings in each update, and show the others as not sampled\n";
 }
 
 int main(int argc, char *argv[])
 {
+    // the only option of both modes, so take it out before looking at the mode
+    MosaicWidget::ColorScheme colorScheme = MosaicWidget::DefaultColors;
+    for (int i = 1; i < argc; i++) {
+        if (QByteArray(argv[i]) == QByteArray("--color-blind")) {
+            colorScheme = MosaicWidget::ColorBlindColors;
+            copy(argv + i + 1, argv + argc + 1, argv + i);
+            argc--;
+            i--;
+        }
+    }
+
     if (argc < 2) {
         printUsage();
         return -1;
@@ -58,11 +84,15 @@ int main(int argc, char *argv[])
     int pid = -1;
     QByteArray host;
     uint port = defaultPort;
+    PageInfo::Options options;
+    bool calibrate = false;
 
     if (QByteArray(argv[1]) != QByteArray("--client")) {
-        if (argc != 2) {
-            printUsage();
-            return -1;
+        for (int i = 2; i < argc; i++) {
+            if (parseSnapshotOption(argc, argv, &i, &options, &calibrate) != ParsedOption) {
+                printUsage();
+                return -1;
+            }
         }
 
         pid = strtoul(argv[1], nullptr, 10);
@@ -80,6 +110,13 @@ int main(int argc, char *argv[])
             cerr << "Found no such PID or process " << argv[1] << "!\n";
             return -1;
         }
+        if (calibrate) {
+            const uint64_t maxPfnGap = PageInfo::calibrateMaxPfnGap();
+            if (maxPfnGap) {
+                cerr << "calibrated --max-pfn-gap " << maxPfnGap << '\n';
+                options.maxPfnGap = maxPfnGap;
+            }
+        }
     } else {
         if (argc < 3 || argc > 4) {
             printUsage();
@@ -101,11 +138,12 @@ int main(int argc, char *argv[])
     MainWindow *mainWindow = nullptr;
     if (pid > 0) {
         cerr << "local mode.\n";
-        mainWindow = new MainWindow(pid);
+        mainWindow = new MainWindow(pid, options);
     } else {
         cerr << "client mode.\n";
         mainWindow = new MainWindow(host, port);
     }
+    mainWindow->mosaicWidget()->setColorScheme(colorScheme);
     mainWindow->show();
     return app.exec();
 }
@@ -0,0 +1,332 @@
+/*
+  readbatch.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "readbatch.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+static bool s_ioUringEnabled = false;
+
+#ifdef HAVE_IO_URING
+
+// Minimal io_uring wrapper that can do just what we need - batches of reads, waiting for all of them.
+// Not using liburing to avoid a dependency for very little code.
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+    bool isValid() const { return m_fd >= 0; }
+    // Reads that fail are retried with pread(), which also covers kernels without IORING_OP_READ, and
+    // short reads are continued with pread(). If io_uring_enter() itself fails, the ring is destroyed
+    // after all reads in flight have completed, isValid() returns false from then on, and the rest of
+    // the reads are done with pread(). Returns false if any read failed, like ReadBatch::execute().
+    bool execute(const vector<ReadBatch::Read> &reads);
+
+private:
+    // handles the completion of reads[cqe.user_data], which is done then; returns false if it failed
+    static bool complete(const vector<ReadBatch::Read> &reads, const io_uring_cqe &cqe);
+    // reaps the completions that are available, returns how many there were. *ok is set to false if
+    // any of them failed.
+    unsigned int reapCompletions(const vector<ReadBatch::Read> &reads, vector<bool> *done, bool *ok);
+    void destroy();
+
+    // the largest batch we submit at once
+    static const unsigned int queueSize = 256;
+
+    int m_fd;
+    void *m_sqRing;
+    size_t m_sqRingSize;
+    void *m_cqRing;
+    size_t m_cqRingSize;
+    io_uring_sqe *m_sqes;
+    size_t m_sqesSize;
+
+    unsigned int *m_sqHead;
+    unsigned int *m_sqTail;
+    unsigned int *m_sqMask;
+    unsigned int *m_sqArray;
+    unsigned int *m_cqHead;
+    unsigned int *m_cqTail;
+    unsigned int *m_cqMask;
+    io_uring_cqe *m_cqes;
+};
+
+IoUring::IoUring()
+   : m_fd(-1),
+     m_sqRing(MAP_FAILED),
+     m_cqRing(MAP_FAILED),
+     m_sqes(static_cast<io_uring_sqe *>(MAP_FAILED))
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_fd = syscall(__NR_io_uring_setup, queueSize, &params);
+    if (m_fd < 0) {
+        return;
+    }
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+        m_sqRingSize = max(m_sqRingSize, m_cqRingSize);
+    }
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                    IORING_OFF_SQ_RING);
+    if (singleMmap) {
+        m_cqRing = m_sqRing;
+        m_cqRingSize = 0; // don't unmap twice
+    } else {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd,
+                        IORING_OFF_CQ_RING);
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+    if (m_sqRing == MAP_FAILED || m_cqRing == MAP_FAILED || m_sqes == MAP_FAILED) {
+        close(m_fd); // the destructor unmaps what was mapped
+        m_fd = -1;
+        return;
+    }
+
+    char *const sq = static_cast<char *>(m_sqRing);
+    m_sqHead = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+    m_sqTail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+    m_sqMask = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+    char *const cq = static_cast<char *>(m_cqRing);
+    m_cqHead = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+    m_cqMask = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring()
+{
+    destroy();
+}
+
+void IoUring::destroy()
+{
+    if (m_sqes != MAP_FAILED) {
+        munmap(m_sqes, m_sqesSize);
+        m_sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    }
+    if (m_cqRing != MAP_FAILED && m_cqRingSize) {
+        munmap(m_cqRing, m_cqRingSize);
+    }
+    m_cqRing = MAP_FAILED;
+    if (m_sqRing != MAP_FAILED) {
+        munmap(m_sqRing, m_sqRingSize);
+        m_sqRing = MAP_FAILED;
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool IoUring::complete(const vector<ReadBatch::Read> &reads, const io_uring_cqe &cqe)
+{
+    const ReadBatch::Read &read = reads[cqe.user_data];
+    if (cqe.res < 0) {
+        return ReadBatch::preadOne(read);
+    } else if (size_t(cqe.res) < read.size) {
+        ReadBatch::Read rest = { read.fd, static_cast<char *>(read.buffer) + cqe.res, read.size - cqe.res,
+                                 read.offset + cqe.res };
+        return ReadBatch::preadOne(rest);
+    }
+    return true;
+}
+
+unsigned int IoUring::reapCompletions(const vector<ReadBatch::Read> &reads, vector<bool> *done, bool *ok)
+{
+    unsigned int cqHead = *m_cqHead;
+    const unsigned int cqTail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    const unsigned int count = cqTail - cqHead;
+    for (; cqHead != cqTail; cqHead++) {
+        const io_uring_cqe &cqe = m_cqes[cqHead & *m_cqMask];
+        *ok = complete(reads, cqe) && *ok;
+        (*done)[cqe.user_data] = true;
+    }
+    __atomic_store_n(m_cqHead, cqHead, __ATOMIC_RELEASE);
+    return count;
+}
+
+bool IoUring::execute(const vector<ReadBatch::Read> &reads)
+{
+    bool ok = true;
+    // which reads have completed, to know what is left to do if io_uring fails
+    vector<bool> done(reads.size(), false);
+    size_t submitPos = 0;
+    while (submitPos < reads.size()) {
+        const unsigned int batchSize = min(size_t(queueSize), reads.size() - submitPos);
+
+        // we are the only producer, so no need to load the tail atomically
+        const unsigned int sqStart = *m_sqTail;
+        unsigned int sqTail = sqStart;
+        for (unsigned int i = 0; i < batchSize; i++) {
+            const ReadBatch::Read &read = reads[submitPos + i];
+            const unsigned int index = sqTail & *m_sqMask;
+            io_uring_sqe *sqe = &m_sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = read.fd;
+            sqe->addr = reinterpret_cast<uint64_t>(read.buffer);
+            sqe->len = read.size;
+            sqe->off = read.offset;
+            sqe->user_data = submitPos + i;
+            m_sqArray[index] = index;
+            sqTail++;
+        }
+        __atomic_store_n(m_sqTail, sqTail, __ATOMIC_RELEASE);
+
+        unsigned int toSubmit = batchSize;
+        unsigned int toComplete = batchSize;
+        while (toComplete) {
+            const int ret = syscall(__NR_io_uring_enter, m_fd, toSubmit, toComplete, IORING_ENTER_GETEVENTS,
+                                    nullptr, 0);
+            if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // Something is quite wrong. The kernel must not write into the buffers of reads that are
+                // still in flight after we return - the buffers are reused - so wait for them, without
+                // relying on io_uring_enter(). The ring itself is not used again.
+                unsigned int inFlight = (__atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) - sqStart) -
+                                        (batchSize - toComplete);
+                while (inFlight) {
+                    const unsigned int reaped = reapCompletions(reads, &done, &ok);
+                    inFlight -= min(inFlight, reaped);
+                    if (inFlight && !reaped) {
+                        usleep(1000);
+                    }
+                }
+                destroy();
+                // do the rest the boring way
+                for (size_t i = submitPos; i < reads.size(); i++) {
+                    if (!done[i]) {
+                        ok = ReadBatch::preadOne(reads[i]) && ok;
+                    }
+                }
+                return ok;
+            }
+            if (ret > 0) {
+                toSubmit -= min(toSubmit, unsigned(ret));
+            }
+            toComplete -= reapCompletions(reads, &done, &ok);
+        }
+        submitPos += batchSize;
+    }
+    return ok;
+}
+
+#else // HAVE_IO_URING
+
+class IoUring
+{
+public:
+    bool isValid() const { return false; }
+    bool execute(const vector<ReadBatch::Read> &) { return false; }
+};
+
+#endif // HAVE_IO_URING
+
+ReadBatch::ReadBatch()
+   : m_ioUring(nullptr)
+{
+}
+
+ReadBatch::~ReadBatch()
+{
+    delete m_ioUring;
+}
+
+void ReadBatch::setIoUringEnabled(bool enabled)
+{
+    s_ioUringEnabled = enabled;
+}
+
+void ReadBatch::add(int fd, void *buffer, size_t size, uint64_t offset)
+{
+    // io_uring can't do reads larger than 4 GiB, and read() can't do more than about 2 GiB at once
+    static const size_t maxReadSize = size_t(1) << 30;
+    char *const bytes = static_cast<char *>(buffer);
+    for (size_t pos = 0; pos < size; pos += maxReadSize) {
+        Read read = { fd, bytes + pos, min(size - pos, maxReadSize), offset + pos };
+        m_reads.push_back(read);
+    }
+}
+
+bool ReadBatch::preadOne(const Read &read)
+{
+    // continue after short reads, until an error or the end of the file
+    char *buffer = static_cast<char *>(read.buffer);
+    size_t size = read.size;
+    uint64_t offset = read.offset;
+    while (size) {
+        const ssize_t ret = pread64(read.fd, buffer, size, offset);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        buffer += ret;
+        size -= ret;
+        offset += ret;
+    }
+    memset(buffer, 0, size);
+    return !size;
+}
+
+bool ReadBatch::execute()
+{
+    bool ok = true;
+    // a single read is not worth setting up io_uring for
+    if (s_ioUringEnabled && !m_ioUring && m_reads.size() > 1) {
+        m_ioUring = new IoUring();
+    }
+    if (m_ioUring && m_ioUring->isValid()) {
+        ok = m_ioUring->execute(m_reads);
+    } else {
+        for (const Read &read : m_reads) {
+            ok = preadOne(read) && ok;
+        }
+    }
+    m_reads.clear();
+    return ok;
+}
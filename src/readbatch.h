@@ -0,0 +1,76 @@
+/*
+  readbatch.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef READBATCH_H
+#define READBATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class IoUring;
+
+// Collects reads from files and performs them all at once. If enabled and possible, that is done using
+// io_uring, which needs a few syscalls for a whole batch instead of one per read. If io_uring is not
+// available (old kernel, disabled by sysctl or seccomp...), it falls back to pread().
+// Short reads are continued where they stopped. Bytes that can't be read, because of an error or the end
+// of the file, are set to 0.
+class ReadBatch
+{
+public:
+    ReadBatch();
+    ~ReadBatch();
+
+    void add(int fd, void *buffer, size_t size, uint64_t offset);
+    // performs all reads added since the last call, returns false if any of them failed
+    bool execute();
+
+    // Off by default: procfs files don't support non-blocking reads, so io_uring hands every read to a
+    // kernel worker thread. That can pay off with many idle cores, but it was slower on a single core.
+    static void setIoUringEnabled(bool enabled);
+
+private:
+    ReadBatch(const ReadBatch &) = delete;
+    ReadBatch &operator=(const ReadBatch &) = delete;
+
+    friend class IoUring;
+    struct Read
+    {
+        int fd;
+        void *buffer;
+        size_t size;
+        uint64_t offset;
+    };
+    // returns false if the read failed
+    static bool preadOne(const Read &read);
+
+    std::vector<Read> m_reads;
+    IoUring *m_ioUring;
+};
+
+#endif // READBATCH_H
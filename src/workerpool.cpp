@@ -0,0 +1,113 @@
+/*
+  workerpool.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "workerpool.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+WorkerPool::WorkerPool(unsigned int threadCount)
+   : m_threadCount(max(threadCount, 1u)),
+     m_jobNumber(0),
+     m_partCount(0),
+     m_partsLeft(0),
+     m_function(nullptr),
+     m_work(nullptr),
+     m_quit(false)
+{
+    // thread i does part i, the last part is done by the calling thread
+    for (unsigned int part = 0; part + 1 < m_threadCount; part++) {
+        m_threads.push_back(thread(&WorkerPool::threadMain, this, part));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_jobStarted.notify_all();
+    for (thread &t : m_threads) {
+        t.join();
+    }
+}
+
+void WorkerPool::runParts(unsigned int partCount, WorkFunction function, void *work)
+{
+    assert(partCount <= m_threadCount);
+    if (partCount <= 1) {
+        if (partCount) {
+            function(work, 0);
+        }
+        return;
+    }
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_jobNumber++;
+        m_partCount = partCount;
+        m_partsLeft = partCount - 1;
+        m_function = function;
+        m_work = work;
+    }
+    m_jobStarted.notify_all();
+    function(work, partCount - 1);
+
+    unique_lock<mutex> lock(m_mutex);
+    while (m_partsLeft) {
+        m_jobDone.wait(lock);
+    }
+}
+
+void WorkerPool::threadMain(unsigned int part)
+{
+    unsigned long jobNumber = 0;
+    unique_lock<mutex> lock(m_mutex);
+    while (true) {
+        while (!m_quit && m_jobNumber == jobNumber) {
+            m_jobStarted.wait(lock);
+        }
+        if (m_quit) {
+            return;
+        }
+        jobNumber = m_jobNumber;
+        if (part + 1 >= m_partCount) {
+            continue; // not needed for this job
+        }
+        const WorkFunction function = m_function;
+        void *const work = m_work;
+        lock.unlock();
+        function(work, part);
+        lock.lock();
+        if (!--m_partsLeft) {
+            m_jobDone.notify_one();
+        }
+    }
+}
@@ -0,0 +1,83 @@
+/*
+  workerpool.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads for running the parts of a job in parallel. The threads are started once and
+// wait for the next job in between, so a job does not start any threads or allocate memory.
+class WorkerPool
+{
+public:
+    // threadCount includes the thread that calls run(), so 1 means that no threads are started
+    explicit WorkerPool(unsigned int threadCount);
+    ~WorkerPool();
+
+    unsigned int threadCount() const { return m_threadCount; }
+
+    // Calls work(part) for each part in [0, partCount) on different threads, the calling thread taking
+    // the last part, and returns when all parts are done. partCount must be <= threadCount(). Only one
+    // run() may be in progress at a time.
+    template<typename Work>
+    void run(unsigned int partCount, Work work)
+    {
+        runParts(partCount, &callWork<Work>, &work);
+    }
+
+private:
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    typedef void (*WorkFunction)(void *work, unsigned int part);
+    template<typename Work>
+    static void callWork(void *work, unsigned int part) { (*static_cast<Work *>(work))(part); }
+
+    void runParts(unsigned int partCount, WorkFunction function, void *work);
+    void threadMain(unsigned int part);
+
+    const unsigned int m_threadCount;
+    std::vector<std::thread> m_threads;
+
+    // the current job, protected by m_mutex
+    std::mutex m_mutex;
+    std::condition_variable m_jobStarted;
+    std::condition_variable m_jobDone;
+    unsigned long m_jobNumber;
+    unsigned int m_partCount;
+    unsigned int m_partsLeft; // parts that the threads have not finished yet
+    WorkFunction m_function;
+    void *m_work;
+    bool m_quit;
+};
+
+#endif // WORKERPOOL_H